@@ -12,12 +12,28 @@
 #define PNLFS_MAGIC           0x434F5746
 
 #define PNLFS_SB_BLOCK_NR              0
+#define PNLFS_GDT_BLOCK_NR             1
 
 #define PNLFS_BLOCK_SIZE       (1 << 12)  /* 4 KiB */
 #define PNLFS_MAX_FILESIZE     (1 << 22)  /* 4 MiB */
 #define PNLFS_FILENAME_LEN            28
 #define PNLFS_MAX_DIR_ENTRIES        128
 
+#define PNLFS_FEATURE_EXTENTS        0x0001
+#define PNLFS_FEATURE_INDIRECT       0x0002
+#define PNLFS_FEATURE_DIR_INDEX      0x0004
+#define PNLFS_FEATURE_FILETYPE       0x0008
+#define PNLFS_FEATURE_BLOCK_GROUPS   0x0010
+#define PNLFS_FEATURE_INLINE_DATA    0x0040
+#define PNLFS_FEATURE_TAIL_PACKING   0x0080
+#define PNLFS_FEATURE_INLINE_DIR     0x0100
+
+#define PNLFS_BLOCKS_PER_GROUP       (PNLFS_BLOCK_SIZE * 8)
+#define PNLFS_INODES_PER_GROUP       (PNLFS_BLOCKS_PER_GROUP / 4)
+
+#define PNLFS_INODE_EXTENTS          0x0001
+#define PNLFS_INODE_INLINE           0x0002
+
 struct pnlfs_inode {
 	mode_t mode;		  /* File mode */
 	uint32_t index_block;	  /* Block with list of block for this file */
@@ -28,7 +44,37 @@ struct pnlfs_inode {
 	};
 };
 
-#define PNLFS_INODES_PER_BLOCK (PNLFS_BLOCK_SIZE / sizeof(struct pnlfs_inode))
+struct pnlfs_extent {
+	uint32_t block;		  /* First logical block */
+	uint32_t start;		  /* First physical block */
+	uint32_t len;		  /* Number of blocks */
+};
+
+struct pnlfs_extent_header {
+	uint32_t nr_extents;	  /* Number of extents in use */
+	uint32_t extent_block;	  /* Extent block, 0 if extents are inline */
+};
+
+#define PNLFS_INODE_DATA_SIZE        96
+#define PNLFS_INLINE_EXTENTS         7
+
+struct pnlfs_extent_root {
+	struct pnlfs_extent_header header;
+	struct pnlfs_extent extents[PNLFS_INLINE_EXTENTS];
+};
+
+struct pnlfs_inode_large {
+	struct pnlfs_inode inode;
+	uint32_t flags;		  /* Inode flags */
+	uint32_t filesize_hi;	  /* High 32 bits of the file size */
+	uint32_t reserved[2];
+	union {
+		struct pnlfs_extent_root extent_root;
+		uint8_t data[PNLFS_INODE_DATA_SIZE];
+	};
+};
+
+#define PNLFS_LARGE_INODE_SIZE       128
 
 struct pnlfs_superblock {
 	uint32_t magic;		  /* Magic number */
@@ -43,7 +89,39 @@ struct pnlfs_superblock {
 	uint32_t nr_free_inodes;  /* Number of free inodes */
 	uint32_t nr_free_blocks;  /* Number of free blocks */
 
-	char padding[4064];       /* Padding to match block size */
+	uint32_t features;	  /* Optional features */
+
+	uint32_t blocks_per_group;/* Number of blocks in a group */
+	uint32_t inodes_per_group;/* Number of inodes in a group */
+	uint32_t nr_groups;       /* Number of groups */
+
+	char padding[4048];       /* Padding to match block size */
+};
+
+struct pnlfs_group_desc {
+	uint32_t block_bitmap;	  /* Block of the bfree bitmap */
+	uint32_t inode_bitmap;	  /* Block of the ifree bitmap */
+	uint32_t inode_table;	  /* First block of the inode table */
+	uint32_t nr_free_blocks;  /* Number of free blocks */
+	uint32_t nr_free_inodes;  /* Number of free inodes */
+	uint32_t nr_dirs;         /* Number of directories */
+	uint32_t reserved[2];
+};
+
+#define PNLFS_DESCS_PER_BLOCK  (PNLFS_BLOCK_SIZE / sizeof(struct pnlfs_group_desc))
+
+static const struct {
+	const char *name;
+	uint32_t flag;
+} features[] = {
+	{ "extents", PNLFS_FEATURE_EXTENTS },
+	{ "indirect", PNLFS_FEATURE_INDIRECT },
+	{ "dir_index", PNLFS_FEATURE_DIR_INDEX },
+	{ "filetype", PNLFS_FEATURE_FILETYPE },
+	{ "block_groups", PNLFS_FEATURE_BLOCK_GROUPS },
+	{ "inline_data", PNLFS_FEATURE_INLINE_DATA },
+	{ "tail_packing", PNLFS_FEATURE_TAIL_PACKING },
+	{ "inline_dir", PNLFS_FEATURE_INLINE_DIR },
 };
 
 struct pnlfs_file_index_block {
@@ -59,10 +137,65 @@ struct pnlfs_dir_block {
 
 static inline void usage(char *appname)
 {
+	size_t i;
+
 	fprintf(stderr,
 		"Usage:\n"
-		"%s disk\n",
+		"%s [-O feature[,feature...]] disk\n"
+		"Features:",
 		appname);
+	for (i = 0; i < sizeof(features) / sizeof(features[0]); i++)
+		fprintf(stderr, " %s", features[i].name);
+	fprintf(stderr, "\n");
+}
+
+/* Parses a comma separated list of features, returns -1 on unknown ones */
+static int parse_features(char *list, uint32_t *flags)
+{
+	char *name;
+	size_t i;
+
+	for (name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+		for (i = 0; i < sizeof(features) / sizeof(features[0]); i++) {
+			if (!strcmp(name, features[i].name))
+				break;
+		}
+		if (i == sizeof(features) / sizeof(features[0])) {
+			fprintf(stderr, "Unknown feature %s\n", name);
+			return -1;
+		}
+		*flags |= features[i].flag;
+	}
+	return 0;
+}
+
+static inline uint32_t inode_size(struct pnlfs_superblock *sb)
+{
+	if (le32toh(sb->features) & (PNLFS_FEATURE_EXTENTS |
+				     PNLFS_FEATURE_INLINE_DATA |
+				     PNLFS_FEATURE_TAIL_PACKING |
+				     PNLFS_FEATURE_INLINE_DIR))
+		return PNLFS_LARGE_INODE_SIZE;
+	return sizeof(struct pnlfs_inode);
+}
+
+/*
+ * Number of data blocks used by the root directory and /foo : the root index
+ * block if directories are hashed, the root dir block, the /foo index block
+ * unless /foo is mapped by extents, and the /foo data block unless /foo is
+ * stored in its inode.
+ */
+static inline uint32_t nr_used_data_blocks(struct pnlfs_superblock *sb)
+{
+	uint32_t nr_used = 3;
+
+	if (le32toh(sb->features) & PNLFS_FEATURE_DIR_INDEX)
+		nr_used++;
+	if (le32toh(sb->features) & PNLFS_FEATURE_INLINE_DATA)
+		return nr_used - 2;
+	if (le32toh(sb->features) & PNLFS_FEATURE_EXTENTS)
+		nr_used--;
+	return nr_used;
 }
 
 /* Returns ceil(a/b) */
@@ -74,37 +207,114 @@ static inline uint32_t idiv_ceil(uint32_t a, uint32_t b)
 	return ret;
 }
 
-static struct pnlfs_superblock *write_superblock(int fd, struct stat *fstats)
+static inline int has_groups(struct pnlfs_superblock *sb)
+{
+	return le32toh(sb->features) & PNLFS_FEATURE_BLOCK_GROUPS;
+}
+
+/* Number of blocks of the inode table of a group */
+static inline uint32_t group_itable_blocks(struct pnlfs_superblock *sb)
+{
+	return le32toh(sb->inodes_per_group) / (PNLFS_BLOCK_SIZE / inode_size(sb));
+}
+
+/*
+ * First block of the bitmaps of group g : the bfree bitmap, followed by the
+ * ifree bitmap and the inode table. Group 0 starts after the descriptors.
+ */
+static inline uint32_t group_first_block(struct pnlfs_superblock *sb, uint32_t g)
+{
+	if (g)
+		return g * le32toh(sb->blocks_per_group);
+	return 1 + idiv_ceil(le32toh(sb->nr_groups), PNLFS_DESCS_PER_BLOCK);
+}
+
+/* First block after the metadata, where the root directory goes */
+static inline uint32_t first_data_block(struct pnlfs_superblock *sb)
+{
+	if (has_groups(sb))
+		return group_first_block(sb, 0) + 2 + group_itable_blocks(sb);
+	return 1 + le32toh(sb->nr_bfree_blocks) +
+		le32toh(sb->nr_ifree_blocks) +
+		le32toh(sb->nr_istore_blocks);
+}
+
+/*
+ * Splits the disk in groups of PNLFS_BLOCKS_PER_GROUP blocks, leaving out a
+ * last group too small to hold more than its own metadata. A disk smaller
+ * than a group gets fewer inodes, one for 4 blocks as in larger groups.
+ */
+static void set_groups(struct pnlfs_superblock *sb, uint32_t nr_blocks)
 {
-	int ret;
+	uint32_t inodes_per_block = PNLFS_BLOCK_SIZE / inode_size(sb);
+	uint32_t nr_groups, inodes_per_group, last;
+
+	nr_groups = idiv_ceil(nr_blocks, PNLFS_BLOCKS_PER_GROUP);
+	inodes_per_group = PNLFS_INODES_PER_GROUP;
+	if (nr_groups == 1)
+		inodes_per_group = idiv_ceil(nr_blocks / 4, inodes_per_block) *
+			inodes_per_block;
+	last = nr_blocks - (nr_groups - 1) * PNLFS_BLOCKS_PER_GROUP;
+	if (nr_groups > 1 &&
+	    last <= 2 + inodes_per_group / inodes_per_block) {
+		nr_groups--;
+		nr_blocks = nr_groups * PNLFS_BLOCKS_PER_GROUP;
+	}
+
+	sb->nr_blocks = htole32(nr_blocks);
+	sb->nr_inodes = htole32(nr_groups * inodes_per_group);
+	sb->blocks_per_group = htole32(PNLFS_BLOCKS_PER_GROUP);
+	sb->inodes_per_group = htole32(inodes_per_group);
+	sb->nr_groups = htole32(nr_groups);
+	/* totals over all the groups */
+	sb->nr_istore_blocks = htole32(nr_groups * group_itable_blocks(sb));
+	sb->nr_ifree_blocks = htole32(nr_groups);
+	sb->nr_bfree_blocks = htole32(nr_groups);
+	sb->nr_free_inodes = htole32(nr_groups * inodes_per_group - 2);
+	sb->nr_free_blocks = htole32(nr_blocks - first_data_block(sb) -
+			nr_used_data_blocks(sb) - (nr_groups - 1) *
+			(2 + group_itable_blocks(sb)));
+}
+
+static struct pnlfs_superblock *write_superblock(int fd, struct stat *fstats,
+						 uint32_t features)
+{
+	ssize_t ret;
 	struct pnlfs_superblock *sb;
 	uint32_t nr_inodes = 0, nr_blocks = 0, nr_ifree_blocks = 0;
 	uint32_t nr_bfree_blocks = 0, nr_data_blocks = 0, nr_istore_blocks = 0;
-	uint32_t mod;
+	uint32_t mod, inodes_per_block;
 
 	sb = malloc(sizeof(struct pnlfs_superblock));
 	if (!sb)
 		return NULL;
+	memset(sb, 0, sizeof(struct pnlfs_superblock));
+	sb->features = htole32(features);
+	inodes_per_block = PNLFS_BLOCK_SIZE / inode_size(sb);
 
 	nr_blocks = fstats->st_size / PNLFS_BLOCK_SIZE;
 	nr_inodes = nr_blocks;
-	mod = nr_inodes % PNLFS_INODES_PER_BLOCK;
+	mod = nr_inodes % inodes_per_block;
 	if (mod != 0)
 		nr_inodes += mod;
-	nr_istore_blocks = idiv_ceil(nr_inodes, PNLFS_INODES_PER_BLOCK);
+	nr_istore_blocks = idiv_ceil(nr_inodes, inodes_per_block);
 	nr_ifree_blocks = idiv_ceil(nr_inodes, PNLFS_BLOCK_SIZE * 8);
 	nr_bfree_blocks = idiv_ceil(nr_blocks, PNLFS_BLOCK_SIZE * 8);
 	nr_data_blocks = nr_blocks - 1 - nr_istore_blocks - nr_ifree_blocks - nr_bfree_blocks;
 
-	memset(sb, 0, sizeof(struct pnlfs_superblock));
 	sb->magic = htole32(PNLFS_MAGIC);
-	sb->nr_blocks = htole32(nr_blocks);
-	sb->nr_inodes = htole32(nr_inodes);
-	sb->nr_istore_blocks = htole32(nr_istore_blocks);
-	sb->nr_ifree_blocks = htole32(nr_ifree_blocks);
-	sb->nr_bfree_blocks = htole32(nr_bfree_blocks);
-	sb->nr_free_inodes = htole32(nr_inodes - 2);
-	sb->nr_free_blocks = htole32(nr_data_blocks - 3);
+	if (features & PNLFS_FEATURE_BLOCK_GROUPS) {
+		set_groups(sb, nr_blocks);
+	} else {
+		sb->nr_blocks = htole32(nr_blocks);
+		sb->nr_inodes = htole32(nr_inodes);
+		sb->nr_istore_blocks = htole32(nr_istore_blocks);
+		sb->nr_ifree_blocks = htole32(nr_ifree_blocks);
+		sb->nr_bfree_blocks = htole32(nr_bfree_blocks);
+		sb->nr_free_inodes = htole32(nr_inodes - 2);
+		sb->nr_free_blocks = htole32(nr_data_blocks -
+				nr_used_data_blocks(sb));
+	}
 
 	ret = write(fd, sb, sizeof(struct pnlfs_superblock));
 	if (ret != sizeof(struct pnlfs_superblock)) {
@@ -119,69 +329,94 @@ static struct pnlfs_superblock *write_superblock(int fd, struct stat *fstats)
 	       "\tnr_ifree_blocks=%u\n"
 	       "\tnr_bfree_blocks=%u\n"
 	       "\tnr_free_inodes=%u\n"
-	       "\tnr_free_blocks=%u\n",
+	       "\tnr_free_blocks=%u\n"
+	       "\tfeatures=%#x\n",
 	       sizeof(struct pnlfs_superblock),
 	       sb->magic, sb->nr_blocks, sb->nr_inodes, sb->nr_istore_blocks,
 	       sb->nr_ifree_blocks, sb->nr_bfree_blocks, sb->nr_free_inodes,
-	       sb->nr_free_blocks);
+	       sb->nr_free_blocks, sb->features);
+	if (has_groups(sb))
+		printf("\tnr_groups=%u\n"
+		       "\tblocks_per_group=%u\n"
+		       "\tinodes_per_group=%u\n",
+		       sb->nr_groups, sb->blocks_per_group,
+		       sb->inodes_per_group);
 
 	return sb;
 }
 
 static int write_inode_store(int fd, struct pnlfs_superblock *sb)
 {
-	int ret = 0, i;
-	struct pnlfs_inode inode;
-	uint32_t first_data_block;
+	ssize_t ret = 0;
+	uint32_t i;
+	struct pnlfs_inode_large large;
+	struct pnlfs_inode *inode = &large.inode;
+	uint32_t data_block, nr_inodes, isize = inode_size(sb);
 
 	/* Root inode (inode 0) */
-	first_data_block = 1 + le32toh(sb->nr_bfree_blocks) +
-		le32toh(sb->nr_ifree_blocks) +
-		le32toh(sb->nr_istore_blocks);
-	memset(&inode, 0, sizeof(inode));
-	inode.mode = htole32(S_IFDIR |
-			     S_IRUSR | S_IRGRP | S_IROTH |
-			     S_IWUSR | S_IWGRP |
-			     S_IXUSR | S_IXGRP | S_IXOTH);
-	inode.index_block = htole32(first_data_block++);
-	inode.filesize = htole32(PNLFS_BLOCK_SIZE);
-	inode.nr_entries = htole32(1);
-
-	ret = write(fd, &inode, sizeof(struct pnlfs_inode));
-	if (ret != sizeof(struct pnlfs_inode))
+	data_block = first_data_block(sb);
+	memset(&large, 0, sizeof(large));
+	inode->mode = htole32(S_IFDIR |
+			      S_IRUSR | S_IRGRP | S_IROTH |
+			      S_IWUSR | S_IWGRP |
+			      S_IXUSR | S_IXGRP | S_IXOTH);
+	inode->index_block = htole32(data_block++);
+	/* the index block of a hashed root maps its dir block */
+	if (le32toh(sb->features) & PNLFS_FEATURE_DIR_INDEX)
+		data_block++;
+	inode->filesize = htole32(PNLFS_BLOCK_SIZE);
+	inode->nr_entries = htole32(1);
+
+	ret = write(fd, &large, isize);
+	if (ret != isize)
 		return -1;
 
 	/* /foo inode (inode 1) */
-	memset(&inode, 0, sizeof(inode));
-	inode.mode = htole32(S_IFREG |
-			     S_IRUSR | S_IRGRP | S_IROTH |
-			     S_IWUSR | S_IWGRP | S_IWOTH);
-	inode.index_block = htole32(first_data_block++);
-	inode.filesize = htole32(strlen("foo\n"));
-	inode.nr_used_blocks = htole32(1);
-
-	ret = write(fd, &inode, sizeof(struct pnlfs_inode));
-	if (ret != sizeof(struct pnlfs_inode))
+	memset(&large, 0, sizeof(large));
+	inode->mode = htole32(S_IFREG |
+			      S_IRUSR | S_IRGRP | S_IROTH |
+			      S_IWUSR | S_IWGRP | S_IWOTH);
+	if (le32toh(sb->features) & PNLFS_FEATURE_INLINE_DATA) {
+		large.flags = htole32(PNLFS_INODE_INLINE);
+		memcpy(large.data, "foo\n", strlen("foo\n"));
+	} else if (le32toh(sb->features) & PNLFS_FEATURE_EXTENTS) {
+		large.flags = htole32(PNLFS_INODE_EXTENTS);
+		large.extent_root.header.nr_extents = htole32(1);
+		large.extent_root.extents[0].block = htole32(0);
+		large.extent_root.extents[0].start = htole32(data_block);
+		large.extent_root.extents[0].len = htole32(1);
+	} else {
+		inode->index_block = htole32(data_block);
+	}
+	inode->filesize = htole32(strlen("foo\n"));
+	if (!(le32toh(sb->features) & PNLFS_FEATURE_INLINE_DATA))
+		inode->nr_used_blocks = htole32(1);
+
+	ret = write(fd, &large, isize);
+	if (ret != isize)
 		return -1;
 
-	/* Other empty inodes (inodes 2 -> end) */
-	memset(&inode, 0, sizeof(inode));
-	for (i = 2; i < le32toh(sb->nr_inodes); i++) {
-		ret = write(fd, &inode, sizeof(struct pnlfs_inode));
-		if (ret != sizeof(struct pnlfs_inode))
+	/* Other empty inodes (inodes 2 -> end of the store or of group 0) */
+	nr_inodes = le32toh(has_groups(sb) ? sb->inodes_per_group :
+			    sb->nr_inodes);
+	memset(&large, 0, sizeof(large));
+	for (i = 2; i < nr_inodes; i++) {
+		ret = write(fd, &large, isize);
+		if (ret != isize)
 			return -1;
 	}
 
-	printf("Inode store: wrote %ld blocks\n"
-	       "\tinode size = %ld\n",
-	       i / PNLFS_INODES_PER_BLOCK, sizeof(struct pnlfs_inode));
+	printf("Inode store: wrote %u blocks\n"
+	       "\tinode size = %u\n",
+	       i / (PNLFS_BLOCK_SIZE / isize), isize);
 
 	return 0;
 }
 
 static int write_ifree_blocks(int fd, struct pnlfs_superblock *sb)
 {
-	int ret = 0, i;
+	ssize_t ret = 0;
+	uint32_t i;
 	uint64_t ifree[PNLFS_BLOCK_SIZE / 8];
 
 	/* Set all bits to 1 */
@@ -201,21 +436,22 @@ static int write_ifree_blocks(int fd, struct pnlfs_superblock *sb)
 			return -1;
 	}
 
-	printf("Ifree blocks: wrote %d blocks\n", i);
+	printf("Ifree blocks: wrote %u blocks\n", i);
 
 	return 0;
 }
 
 static int write_bfree_blocks(int fd, struct pnlfs_superblock *sb)
 {
-	int ret = 0, i;
+	ssize_t ret = 0;
+	uint32_t i;
 	uint64_t bfree[PNLFS_BLOCK_SIZE / 8], mask, line;
 	uint32_t nr_used = le32toh(sb->nr_istore_blocks) +
 		le32toh(sb->nr_ifree_blocks) +
-		le32toh(sb->nr_bfree_blocks) + 4;
+		le32toh(sb->nr_bfree_blocks) + 1 + nr_used_data_blocks(sb);
 
 	/*
-	 * First blocks (incl. sb + istore + ifree + bfree + 3 used blocks)
+	 * First blocks (incl. sb + istore + ifree + bfree + used data blocks)
 	 * we suppose it won't go further than the first block
 	 */
 	memset(bfree, 0xff, PNLFS_BLOCK_SIZE);
@@ -243,34 +479,142 @@ static int write_bfree_blocks(int fd, struct pnlfs_superblock *sb)
 			return errno;
 	}
 
-	printf("Bfree blocks: wrote %d blocks\n", i);
+	printf("Bfree blocks: wrote %u blocks\n", i);
 
 	return 0;
 }
 
+/* Writes a bitmap block where the bits from first_free to nr_bits are set */
+static int write_bitmap(int fd, uint32_t first_free, uint32_t nr_bits)
+{
+	uint8_t bitmap[PNLFS_BLOCK_SIZE];
+	uint32_t i;
+
+	memset(bitmap, 0, PNLFS_BLOCK_SIZE);
+	for (i = first_free; i < nr_bits; i++)
+		bitmap[i / 8] |= 1 << (i % 8);
+	if (write(fd, bitmap, PNLFS_BLOCK_SIZE) != PNLFS_BLOCK_SIZE)
+		return -1;
+	return 0;
+}
+
+/*
+ * Writes the group descriptors, then the bitmaps and the inode table of each
+ * group. The root directory and /foo take the first inodes and data blocks
+ * of group 0.
+ */
+static int write_groups(int fd, struct pnlfs_superblock *sb)
+{
+	struct pnlfs_group_desc *descs;
+	char zero[PNLFS_BLOCK_SIZE];
+	uint32_t nr_groups = le32toh(sb->nr_groups);
+	uint32_t bpg = le32toh(sb->blocks_per_group);
+	uint32_t ipg = le32toh(sb->inodes_per_group);
+	uint32_t itable = group_itable_blocks(sb);
+	uint32_t nr_gdt = idiv_ceil(nr_groups, PNLFS_DESCS_PER_BLOCK);
+	uint32_t g, i, first, nr_blocks, nr_used, nr_used_inodes;
+	int ret = -1;
+
+	descs = calloc(nr_gdt, PNLFS_BLOCK_SIZE);
+	if (!descs)
+		return -1;
+	memset(zero, 0, PNLFS_BLOCK_SIZE);
+	for (g = 0; g < nr_groups; g++) {
+		first = group_first_block(sb, g);
+		nr_blocks = le32toh(sb->nr_blocks) - g * bpg;
+		if (nr_blocks > bpg)
+			nr_blocks = bpg;
+		/* the metadata are at the beginning of the group */
+		nr_used = first - g * bpg + 2 + itable;
+		nr_used_inodes = 0;
+		if (!g) {
+			nr_used += nr_used_data_blocks(sb);
+			nr_used_inodes = 2;
+		}
+		descs[g].block_bitmap = htole32(first);
+		descs[g].inode_bitmap = htole32(first + 1);
+		descs[g].inode_table = htole32(first + 2);
+		descs[g].nr_free_blocks = htole32(nr_blocks - nr_used);
+		descs[g].nr_free_inodes = htole32(ipg - nr_used_inodes);
+		/* the root */
+		descs[g].nr_dirs = htole32(g ? 0 : 1);
+
+		if (lseek(fd, (off_t) first * PNLFS_BLOCK_SIZE, SEEK_SET) < 0)
+			goto free_descs;
+		if (write_bitmap(fd, nr_used, nr_blocks) != 0 ||
+		    write_bitmap(fd, nr_used_inodes, ipg) != 0)
+			goto free_descs;
+		if (!g) {
+			if (write_inode_store(fd, sb) != 0)
+				goto free_descs;
+			continue;
+		}
+		for (i = 0; i < itable; i++) {
+			if (write(fd, zero, PNLFS_BLOCK_SIZE) != PNLFS_BLOCK_SIZE)
+				goto free_descs;
+		}
+	}
+
+	if (lseek(fd, PNLFS_GDT_BLOCK_NR * PNLFS_BLOCK_SIZE, SEEK_SET) < 0)
+		goto free_descs;
+	if (write(fd, descs, nr_gdt * PNLFS_BLOCK_SIZE) !=
+	    nr_gdt * PNLFS_BLOCK_SIZE)
+		goto free_descs;
+	if (lseek(fd, (off_t) first_data_block(sb) * PNLFS_BLOCK_SIZE,
+		  SEEK_SET) < 0)
+		goto free_descs;
+	printf("Groups: wrote %u groups\n"
+	       "\tdescriptors = %u blocks\n"
+	       "\tinode table = %u blocks per group\n",
+	       nr_groups, nr_gdt, itable);
+	ret = 0;
+free_descs:
+	free(descs);
+	return ret;
+}
+
 static int write_data_blocks(int fd, struct pnlfs_superblock *sb)
 {
-	int ret = 0;
+	ssize_t ret = 0;
 	struct pnlfs_dir_block root_block;
-	struct pnlfs_file_index_block foo_block;
+	struct pnlfs_file_index_block foo_block, root_index;
 	char foo[PNLFS_BLOCK_SIZE];
-	uint32_t first_block = le32toh(sb->nr_istore_blocks) +
-		le32toh(sb->nr_ifree_blocks) + le32toh(sb->nr_bfree_blocks) + 3;
+	uint32_t root_block_nr = first_data_block(sb);
+	uint32_t first_block = root_block_nr - 1 + nr_used_data_blocks(sb);
+
+	/* Root index block, mapping the root block */
+	if (le32toh(sb->features) & PNLFS_FEATURE_DIR_INDEX) {
+		memset(&root_index, 0, sizeof(root_index));
+		root_index.blocks[0] = htole32(root_block_nr + 1);
+		ret = write(fd, &root_index, sizeof(root_index));
+		if (ret != PNLFS_BLOCK_SIZE)
+			return errno;
+	}
 
 	/* Root block (/) */
 	memset(&root_block, 0, sizeof(root_block));
 	strncpy(root_block.files[0].filename, "foo", PNLFS_FILENAME_LEN);
 	root_block.files[0].inode = htole32(1);
+	/* the last byte of the name holds the DT_ type of the entry */
+	if (le32toh(sb->features) & PNLFS_FEATURE_FILETYPE)
+		root_block.files[0].filename[PNLFS_FILENAME_LEN - 1] =
+			(S_IFREG & S_IFMT) >> 12;
 	ret = write(fd, &root_block, sizeof(root_block));
 	if (ret != PNLFS_BLOCK_SIZE)
 		return errno;
 
-	/* foo index block (/foo) */
-	memset(&foo_block, 0, sizeof(foo_block));
-	foo_block.blocks[0] = htole32(first_block);
-	ret = write(fd, &foo_block, sizeof(foo_block));
-	if (ret != PNLFS_BLOCK_SIZE)
-		return errno;
+	/* /foo has no block when it is stored in its inode */
+	if (le32toh(sb->features) & PNLFS_FEATURE_INLINE_DATA)
+		return 0;
+
+	/* foo index block (/foo), unless it is mapped by an extent */
+	if (!(le32toh(sb->features) & PNLFS_FEATURE_EXTENTS)) {
+		memset(&foo_block, 0, sizeof(foo_block));
+		foo_block.blocks[0] = htole32(first_block);
+		ret = write(fd, &foo_block, sizeof(foo_block));
+		if (ret != PNLFS_BLOCK_SIZE)
+			return errno;
+	}
 
 	/* /foo data block */
 	memset(foo, 0, PNLFS_BLOCK_SIZE);
@@ -284,18 +628,32 @@ static int write_data_blocks(int fd, struct pnlfs_superblock *sb)
 
 int main(int argc, char **argv)
 {
-	int ret = EXIT_SUCCESS, fd;
+	int ret = EXIT_SUCCESS, fd, opt;
 	long int min_size;
 	struct stat stat_buf;
 	struct pnlfs_superblock *sb = NULL;
-
-	if (argc != 2) {
+	uint32_t flags = 0;
+
+	while ((opt = getopt(argc, argv, "O:")) != -1) {
+		switch (opt) {
+		case 'O':
+			if (parse_features(optarg, &flags) != 0) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 1) {
 		usage(argv[0]);
 		return EXIT_FAILURE;
 	}
 
 	/* Open disk image */
-	fd = open(argv[1], O_RDWR);
+	fd = open(argv[optind], O_RDWR);
 	if (fd == -1) {
 		perror("open():");
 		return EXIT_FAILURE;
@@ -321,13 +679,24 @@ int main(int argc, char **argv)
 	}
 
 	/* Write superblock (block 0) */
-	sb = write_superblock(fd, &stat_buf);
+	sb = write_superblock(fd, &stat_buf, flags);
 	if (!sb) {
 		perror("write_superblock():");
 		ret = EXIT_FAILURE;
 		goto fclose;
 	}
 
+	/* Write the groups, with their bitmaps and inode tables */
+	if (has_groups(sb)) {
+		ret = write_groups(fd, sb);
+		if (ret != 0) {
+			perror("write_groups():");
+			ret = EXIT_FAILURE;
+			goto free_sb;
+		}
+		goto write_data;
+	}
+
 	/* Write inode store blocks (from block 1) */
 	ret = write_inode_store(fd, sb);
 	if (ret != 0) {
@@ -352,6 +721,7 @@ int main(int argc, char **argv)
 		goto free_sb;
 	}
 
+write_data:
 	/* Write data blocks */
 	ret = write_data_blocks(fd, sb);
 	if (ret != 0) {
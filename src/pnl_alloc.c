@@ -0,0 +1,1231 @@
+#include <linux/fs.h>
+#include <linux/atomic.h>
+#include <linux/bitops.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/math64.h>
+#include <linux/percpu.h>
+#include <linux/percpu_counter.h>
+#include <linux/random.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <uapi/asm-generic/errno-base.h>
+#include <uapi/asm-generic/errno.h>
+#include "pnlfs.h"
+#include "pnl_alloc.h"
+#include "pnl_stats.h"
+#include "pnl_trace.h"
+
+/*
+ * Inodes and blocks are allocated group by group, straight from the buffers
+ * of the group bitmaps and without any lock : a free bit is looked for with
+ * find_next_bit_le() and claimed with test_and_clear_bit_le(), so that two
+ * CPUs never get the same bit and just look further when they race for it.
+ *
+ * The number of free bits of each group is kept alongside, so that a search
+ * skips the full groups without reading their bitmaps, which keeps
+ * allocations cheap on a nearly full disk. With PNLFS_FEATURE_BLOCK_GROUPS,
+ * these counts come from the group descriptors, else from the bitmaps
+ * themselves, and a group is only read from the disk the first time it is
+ * used.
+ *
+ * A group keeps a reference to its bitmaps once read, which a shrinker
+ * releases under memory pressure when they are clean and unused, so that
+ * they are read again on their next use.
+ *
+ * Changed groups are queued on sb_info->dirty_groups, so that a sync only
+ * writes the bitmaps and descriptors which changed since the previous one.
+ * The counts reach the descriptors at that point only, allocations and
+ * frees never touch the descriptor blocks.
+ */
+
+static int pnl_count_free(struct buffer_head *bh, uint32_t nr_bits)
+{
+	unsigned long bit;
+	int count = 0;
+
+	for (bit = find_next_bit_le(bh->b_data, nr_bits, 0); bit < nr_bits;
+	     bit = find_next_bit_le(bh->b_data, nr_bits, bit + 1))
+		count++;
+	return count;
+}
+
+/*
+ * Returns a reference to a bitmap of grp, to be released with brelse(),
+ * reading it on first use.
+ */
+static struct buffer_head *pnl_group_bitmap(struct super_block *sb,
+		struct pnl_group *grp, int inodes)
+{
+	struct pnlfs_sb_info *sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+	struct buffer_head *bh, **slot;
+	uint32_t bno;
+
+	slot = inodes ? &grp->ifree_bh : &grp->bfree_bh;
+	spin_lock(&grp->lock);
+	bh = *slot;
+	if (bh)
+		get_bh(bh);
+	spin_unlock(&grp->lock);
+	if (bh)
+		return bh;
+
+	bno = inodes ? grp->inode_bitmap : grp->block_bitmap;
+	bh = pnl_sb_bread(sb, bno);
+	if (!bh) {
+		pr_warn("[pnlfs] %s : error when opening block sector %d\n",
+				__func__, bno);
+		return ERR_PTR(-EIO);
+	}
+	/* a racing reader got the same buffer, which is kept once */
+	spin_lock(&grp->lock);
+	if (!*slot) {
+		get_bh(bh);
+		*slot = bh;
+		atomic_inc(&sb_info->nr_bitmaps);
+	}
+	spin_unlock(&grp->lock);
+	return bh;
+}
+
+static int pnl_read_group_desc(struct super_block *sb, struct pnl_group *grp)
+{
+	struct buffer_head *bh;
+	struct pnlfs_group_desc *desc;
+	uint32_t bno = PNLFS_GDT_BLOCK_NR + grp->nr / PNLFS_DESCS_PER_BLOCK;
+
+	bh = pnl_sb_bread(sb, bno);
+	if (!bh) {
+		pr_warn("[pnlfs] %s : error when opening block sector %d\n",
+				__func__, bno);
+		return -EIO;
+	}
+	desc = (struct pnlfs_group_desc *) bh->b_data +
+		grp->nr % PNLFS_DESCS_PER_BLOCK;
+	grp->block_bitmap = le32_to_cpu(desc->block_bitmap);
+	grp->inode_bitmap = le32_to_cpu(desc->inode_bitmap);
+	grp->inode_table = le32_to_cpu(desc->inode_table);
+	atomic_set(&grp->free_blocks, le32_to_cpu(desc->nr_free_blocks));
+	atomic_set(&grp->free_inodes, le32_to_cpu(desc->nr_free_inodes));
+	atomic_set(&grp->nr_dirs, le32_to_cpu(desc->nr_dirs));
+	brelse(bh);
+	if (atomic_read(&grp->free_blocks) > grp->nr_blocks ||
+			atomic_read(&grp->free_inodes) > grp->nr_inodes ||
+			atomic_read(&grp->nr_dirs) > grp->nr_inodes) {
+		pr_warn("[pnlfs] %s : corrupted descriptor of group %d\n",
+				__func__, grp->nr);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/* The free counts of the global bitmaps are only known by reading them */
+static int pnl_read_legacy_group(struct super_block *sb,
+		struct pnl_group *grp)
+{
+	struct pnlfs_sb_info *sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+	struct buffer_head *bh;
+
+	grp->inode_bitmap = PNLFS_ISTORE_NR + sb_info->nr_istore_blocks +
+		grp->nr;
+	grp->block_bitmap = grp->inode_bitmap + sb_info->nr_ifree_blocks;
+	grp->inode_table = PNLFS_ISTORE_NR +
+		grp->first_ino / sb_info->inodes_per_block;
+	if (grp->nr_inodes) {
+		bh = pnl_group_bitmap(sb, grp, 1);
+		if (IS_ERR(bh))
+			return PTR_ERR(bh);
+		atomic_set(&grp->free_inodes,
+				pnl_count_free(bh, grp->nr_inodes));
+		brelse(bh);
+	}
+	if (grp->nr_blocks) {
+		bh = pnl_group_bitmap(sb, grp, 0);
+		if (IS_ERR(bh))
+			return PTR_ERR(bh);
+		atomic_set(&grp->free_blocks,
+				pnl_count_free(bh, grp->nr_blocks));
+		brelse(bh);
+	}
+	return 0;
+}
+
+static void pnl_put_group(struct super_block *sb, struct pnl_group *grp)
+{
+	struct pnlfs_sb_info *sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+
+	if (grp->bfree_bh)
+		atomic_dec(&sb_info->nr_bitmaps);
+	if (grp->ifree_bh)
+		atomic_dec(&sb_info->nr_bitmaps);
+	brelse(grp->bfree_bh);
+	brelse(grp->ifree_bh);
+	kfree(grp);
+}
+
+/* Returns the group g, reading it on first use */
+struct pnl_group *pnl_get_group(struct super_block *sb, uint32_t g)
+{
+	struct pnlfs_sb_info *sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+	struct pnl_group *grp, *old;
+	int err;
+
+	grp = READ_ONCE(sb_info->groups[g]);
+	if (grp)
+		return grp;
+	grp = kzalloc(sizeof(struct pnl_group), GFP_NOFS);
+	if (!grp)
+		return ERR_PTR(-ENOMEM);
+	spin_lock_init(&grp->lock);
+	INIT_LIST_HEAD(&grp->dirty);
+	grp->nr = g;
+	grp->first_block = g * sb_info->blocks_per_group;
+	if (grp->first_block < sb_info->nr_blocks)
+		grp->nr_blocks = min(sb_info->blocks_per_group,
+				sb_info->nr_blocks - grp->first_block);
+	grp->first_ino = g * sb_info->inodes_per_group;
+	if (grp->first_ino < sb_info->nr_inodes)
+		grp->nr_inodes = min(sb_info->inodes_per_group,
+				sb_info->nr_inodes - grp->first_ino);
+	if (sb_info->features & PNLFS_FEATURE_BLOCK_GROUPS)
+		err = pnl_read_group_desc(sb, grp);
+	else
+		err = pnl_read_legacy_group(sb, grp);
+	if (err) {
+		pnl_put_group(sb, grp);
+		return ERR_PTR(err);
+	}
+	old = cmpxchg(&sb_info->groups[g], NULL, grp);
+	if (old) {
+		pnl_put_group(sb, grp);
+		return old;
+	}
+	return grp;
+}
+
+/*
+ * Writes the counts of a group back to its descriptor. Only pnl_alloc_sync()
+ * does, once per dirty group, so that allocations never touch the block of
+ * descriptors all CPUs share.
+ */
+static int pnl_group_update(struct super_block *sb, struct pnl_group *grp)
+{
+	struct pnlfs_sb_info *sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+	struct buffer_head *bh;
+	struct pnlfs_group_desc *desc;
+	uint32_t bno = PNLFS_GDT_BLOCK_NR + grp->nr / PNLFS_DESCS_PER_BLOCK;
+
+	if (!(sb_info->features & PNLFS_FEATURE_BLOCK_GROUPS))
+		return 0;
+	bh = pnl_sb_bread(sb, bno);
+	if (!bh) {
+		pr_warn("[pnlfs] %s : error when opening block sector %d\n",
+				__func__, bno);
+		return -EIO;
+	}
+	desc = (struct pnlfs_group_desc *) bh->b_data +
+		grp->nr % PNLFS_DESCS_PER_BLOCK;
+	/* the groups sharing the block update it one after the other */
+	lock_buffer(bh);
+	desc->nr_free_blocks = cpu_to_le32(atomic_read(&grp->free_blocks));
+	desc->nr_free_inodes = cpu_to_le32(atomic_read(&grp->free_inodes));
+	desc->nr_dirs = cpu_to_le32(atomic_read(&grp->nr_dirs));
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+	brelse(bh);
+	return 0;
+}
+
+/* Queues grp for the next pnl_alloc_sync() */
+static void pnl_group_dirty(struct super_block *sb, struct pnl_group *grp)
+{
+	struct pnlfs_sb_info *sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+
+	if (test_bit(PNL_GROUP_DIRTY, &grp->state))
+		return;
+	spin_lock(&sb_info->dirty_lock);
+	if (!test_and_set_bit(PNL_GROUP_DIRTY, &grp->state)) {
+		list_add_tail(&grp->dirty, &sb_info->dirty_groups);
+		sb_info->nr_dirty_groups++;
+	}
+	spin_unlock(&sb_info->dirty_lock);
+}
+
+/*
+ * Free counts of the whole disk, which statfs reads without summing the
+ * groups. Each CPU keeps its own delta until it grows past the batch.
+ */
+static struct percpu_counter *pnl_free_counter(struct super_block *sb,
+		int inodes)
+{
+	struct pnlfs_sb_info *sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+
+	return inodes ? &sb_info->free_inodes : &sb_info->free_blocks;
+}
+
+/*
+ * Claims a free inode or block of grp from the bit start onwards, wrapping
+ * around. Returns -ENOSPC if the group is full.
+ */
+static int pnl_group_alloc(struct super_block *sb, struct pnl_group *grp,
+		int inodes, uint32_t start)
+{
+	struct buffer_head *bh;
+	atomic_t *free;
+	uint32_t nr_bits;
+	unsigned long bit;
+	int pass;
+
+	free = inodes ? &grp->free_inodes : &grp->free_blocks;
+	if (atomic_read(free) <= 0)
+		return -ENOSPC;
+	bh = pnl_group_bitmap(sb, grp, inodes);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	/* a reserved bit is there, unless another CPU got past us for it */
+	if (atomic_dec_if_positive(free) < 0) {
+		brelse(bh);
+		return -ENOSPC;
+	}
+	nr_bits = inodes ? grp->nr_inodes : grp->nr_blocks;
+	bit = start < nr_bits ? start : 0;
+	for (pass = 0; pass < 3; pass++, bit = 0) {
+		for (bit = find_next_bit_le(bh->b_data, nr_bits, bit);
+		     bit < nr_bits;
+		     bit = find_next_bit_le(bh->b_data, nr_bits, bit + 1)) {
+			if (test_and_clear_bit_le(bit, bh->b_data)) {
+				mark_buffer_dirty(bh);
+				brelse(bh);
+				percpu_counter_dec(pnl_free_counter(sb,
+							inodes));
+				pnl_group_dirty(sb, grp);
+				return bit;
+			}
+		}
+	}
+	brelse(bh);
+	atomic_inc(free);
+	pr_warn("[pnlfs] %s : free count of group %d is wrong\n", __func__,
+			grp->nr);
+	return -ENOSPC;
+}
+
+static void pnl_group_free(struct super_block *sb, struct pnl_group *grp,
+		int inodes, uint32_t bit)
+{
+	struct buffer_head *bh;
+
+	bh = pnl_group_bitmap(sb, grp, inodes);
+	if (IS_ERR(bh))
+		return;
+	if (test_and_set_bit_le(bit, bh->b_data)) {
+		pr_warn("[pnlfs] %s : bit %d of group %d is already free\n",
+				__func__, bit, grp->nr);
+		brelse(bh);
+		return;
+	}
+	mark_buffer_dirty(bh);
+	brelse(bh);
+	percpu_counter_inc(pnl_free_counter(sb, inodes));
+	atomic_inc(inodes ? &grp->free_inodes : &grp->free_blocks);
+	pnl_group_dirty(sb, grp);
+}
+
+/*
+ * Allocates from the group g onwards, starting at the bit start of g.
+ * Returns the bit claimed, relative to the start of the whole disk.
+ */
+static int pnl_alloc_bit(struct super_block *sb, uint32_t g, int inodes,
+		uint32_t start)
+{
+	struct pnlfs_sb_info *sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+	struct pnl_group *grp;
+	uint32_t i;
+	int bit;
+
+	for (i = 0; i < sb_info->nr_groups; i++) {
+		grp = pnl_get_group(sb, g);
+		if (IS_ERR(grp))
+			return PTR_ERR(grp);
+		pnl_stat_inc(sb, inodes ? PNL_STAT_INODE_GROUPS :
+				PNL_STAT_BLOCK_GROUPS);
+		bit = pnl_group_alloc(sb, grp, inodes, i ? 0 : start);
+		if (bit >= 0)
+			return bit + (inodes ? grp->first_ino :
+					grp->first_block);
+		if (bit != -ENOSPC)
+			return bit;
+		if (++g == sb_info->nr_groups)
+			g = 0;
+	}
+	return -ENOSPC;
+}
+
+/*
+ * Allocates the first free block from goal onwards, so that the blocks of a
+ * file follow each other. Without goal, each CPU goes on from its last
+ * allocation, in its own part of the disk.
+ */
+int pnl_alloc_block(struct super_block *sb, uint32_t goal)
+{
+	struct pnlfs_sb_info *sb_info;
+	int bno;
+
+	sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+	if (!goal)
+		goal = this_cpu_read(*sb_info->block_hint);
+	if (goal >= sb_info->nr_blocks)
+		goal = 0;
+	bno = pnl_alloc_bit(sb, goal / sb_info->blocks_per_group, 0,
+			goal % sb_info->blocks_per_group);
+	trace_pnlfs_alloc_block(sb, goal, bno);
+	if (bno < 0) {
+		pr_warn("[pnlfs] %s : no more blocks to allocate\n",
+				__func__);
+		return bno;
+	}
+	this_cpu_write(*sb_info->block_hint, bno + 1);
+	pnl_stat_inc(sb, PNL_STAT_BLOCK_ALLOCS);
+	return bno;
+}
+
+/*
+ * Claims up to max blocks of grp right after the block start, already
+ * claimed, stopping at the first one in use. Returns the number claimed.
+ */
+static uint32_t pnl_group_extend(struct super_block *sb,
+		struct pnl_group *grp, uint32_t start, uint32_t max)
+{
+	struct buffer_head *bh;
+	uint32_t n;
+
+	bh = pnl_group_bitmap(sb, grp, 0);
+	if (IS_ERR(bh))
+		return 0;
+	for (n = 0; n < max && start + 1 + n < grp->nr_blocks; n++) {
+		if (atomic_dec_if_positive(&grp->free_blocks) < 0)
+			break;
+		if (!test_and_clear_bit_le(start + 1 + n, bh->b_data)) {
+			atomic_inc(&grp->free_blocks);
+			break;
+		}
+	}
+	if (n) {
+		mark_buffer_dirty(bh);
+		percpu_counter_sub(pnl_free_counter(sb, 0), n);
+		pnl_group_dirty(sb, grp);
+	}
+	brelse(bh);
+	return n;
+}
+
+/*
+ * Returns the first bit of a run of count free blocks of grp, looked for from
+ * the bit start onwards and then from the start of the group.
+ */
+static int pnl_group_find_run(struct super_block *sb, struct pnl_group *grp,
+		uint32_t start, uint32_t count)
+{
+	struct buffer_head *bh;
+	unsigned long bit, end;
+	int pass, ret = -ENOSPC;
+
+	if (atomic_read(&grp->free_blocks) < (int) count)
+		return -ENOSPC;
+	bh = pnl_group_bitmap(sb, grp, 0);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	bit = start < grp->nr_blocks ? start : 0;
+	for (pass = 0; pass < 2; pass++, bit = 0) {
+		for (bit = find_next_bit_le(bh->b_data, grp->nr_blocks, bit);
+		     bit < grp->nr_blocks;
+		     bit = find_next_bit_le(bh->b_data, grp->nr_blocks, end)) {
+			end = find_next_zero_bit_le(bh->b_data, grp->nr_blocks,
+					bit);
+			if (end - bit >= count) {
+				ret = bit;
+				goto find_run_out;
+			}
+		}
+	}
+find_run_out:
+	brelse(bh);
+	return ret;
+}
+
+/*
+ * Returns the first block of a run of count free blocks, in the group of
+ * goal or in the following ones.
+ */
+static int pnl_find_run(struct super_block *sb, uint32_t goal,
+		uint32_t count)
+{
+	struct pnlfs_sb_info *sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+	struct pnl_group *grp;
+	uint32_t g, i;
+	int bit;
+
+	g = goal / sb_info->blocks_per_group;
+	for (i = 0; i < sb_info->nr_groups; i++) {
+		grp = pnl_get_group(sb, g);
+		if (IS_ERR(grp))
+			return PTR_ERR(grp);
+		bit = pnl_group_find_run(sb, grp, i ? 0 :
+				goal % sb_info->blocks_per_group, count);
+		if (bit >= 0)
+			return bit + grp->first_block;
+		if (bit != -ENOSPC)
+			return bit;
+		if (++g == sb_info->nr_groups)
+			g = 0;
+	}
+	return -ENOSPC;
+}
+
+/*
+ * Allocates a run of up to *count contiguous blocks from goal onwards. The
+ * bitmaps are searched for a run of *count free blocks first, the run is
+ * otherwise the one found at the first free block. Returns the first block
+ * and sets *count to the length of the run.
+ */
+int pnl_alloc_blocks(struct super_block *sb, uint32_t goal, uint32_t *count)
+{
+	struct pnlfs_sb_info *sb_info;
+	struct pnl_group *grp;
+	uint32_t n;
+	int bno;
+
+	sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+	if (!goal)
+		goal = this_cpu_read(*sb_info->block_hint);
+	if (goal >= sb_info->nr_blocks)
+		goal = 0;
+	if (*count > 1) {
+		/* another CPU may take part of it first, the run is then cut */
+		bno = pnl_find_run(sb, goal, *count);
+		if (bno > 0)
+			goal = bno;
+	}
+	bno = pnl_alloc_block(sb, goal);
+	if (bno < 0)
+		return bno;
+	n = 1;
+	if (*count > 1) {
+		grp = pnl_get_group(sb, bno / sb_info->blocks_per_group);
+		if (!IS_ERR(grp))
+			n += pnl_group_extend(sb, grp, bno - grp->first_block,
+					*count - 1);
+	}
+	this_cpu_write(*sb_info->block_hint, bno + n);
+	pnl_stat_add(sb, PNL_STAT_BLOCK_ALLOCS, n - 1);
+	*count = n;
+	return bno;
+}
+
+void pnl_free_block(struct super_block *sb, uint32_t bno)
+{
+	struct pnlfs_sb_info *sb_info;
+	struct pnl_group *grp;
+
+	sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+	if (bno >= sb_info->nr_blocks) {
+		pr_warn("[pnlfs] %s : freeing block %d out of the disk\n",
+				__func__, bno);
+		return;
+	}
+	grp = pnl_get_group(sb, bno / sb_info->blocks_per_group);
+	if (IS_ERR(grp))
+		return;
+	pnl_group_free(sb, grp, 0, bno - grp->first_block);
+}
+
+/*
+ * Fragments are carved in blocks shared by small files, see struct
+ * pnlfs_frag_header. The few blocks known to have free slots are kept in
+ * sb_info->frag_blocks : a block is remembered when it is allocated or when
+ * one of its fragments is freed, and forgotten once full or freed. Blocks
+ * forgotten over a remount are only used again once one of their fragments
+ * is freed.
+ */
+static uint32_t pnl_frag_mask(uint32_t slot, uint32_t nr_slots)
+{
+	return ((1U << nr_slots) - 1) << slot;
+}
+
+/* Returns the first of nr_slots free slots in a row, 0 if there are none */
+static uint32_t pnl_frag_find(uint32_t used, uint32_t nr_slots)
+{
+	uint32_t slot;
+
+	for (slot = 1; slot + nr_slots <= PNLFS_FRAGS_PER_BLOCK; slot++)
+		if (!(used & pnl_frag_mask(slot, nr_slots)))
+			return slot;
+	return 0;
+}
+
+/* Moves bno first in sb_info->frag_blocks, the oldest one may be dropped */
+static void pnl_frag_remember(struct pnlfs_sb_info *sb_info, uint32_t bno)
+{
+	uint32_t i;
+
+	for (i = 0; i < sb_info->nr_frag_blocks; i++)
+		if (sb_info->frag_blocks[i] == bno)
+			break;
+	if (i == sb_info->nr_frag_blocks) {
+		if (i < PNL_FRAG_BLOCKS)
+			sb_info->nr_frag_blocks++;
+		else
+			i--;
+	}
+	memmove(&sb_info->frag_blocks[1], &sb_info->frag_blocks[0],
+			i * sizeof(uint32_t));
+	sb_info->frag_blocks[0] = bno;
+}
+
+static void pnl_frag_forget(struct pnlfs_sb_info *sb_info, uint32_t bno)
+{
+	uint32_t i;
+
+	for (i = 0; i < sb_info->nr_frag_blocks; i++) {
+		if (sb_info->frag_blocks[i] == bno) {
+			sb_info->nr_frag_blocks--;
+			memmove(&sb_info->frag_blocks[i],
+					&sb_info->frag_blocks[i + 1],
+					(sb_info->nr_frag_blocks - i) *
+					sizeof(uint32_t));
+			return;
+		}
+	}
+}
+
+/*
+ * Allocates nr_slots slots in a row, in a known block of fragments with room
+ * for them, else in a new block allocated from goal onwards. Returns the
+ * block and sets *slot to the first slot.
+ */
+int pnl_frag_alloc(struct super_block *sb, uint32_t goal, uint32_t nr_slots,
+		uint32_t *slot)
+{
+	struct pnlfs_sb_info *sb_info;
+	struct pnlfs_frag_header *hdr;
+	struct buffer_head *bh;
+	uint32_t used, i;
+	int bno;
+
+	if (!nr_slots || nr_slots >= PNLFS_FRAGS_PER_BLOCK)
+		return -EINVAL;
+	sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+	mutex_lock(&sb_info->frag_lock);
+	for (i = 0; i < sb_info->nr_frag_blocks; i++) {
+		bno = sb_info->frag_blocks[i];
+		bh = pnl_sb_bread(sb, bno);
+		if (!bh)
+			continue;
+		hdr = (struct pnlfs_frag_header *) bh->b_data;
+		used = le32_to_cpu(hdr->used);
+		*slot = pnl_frag_find(used, nr_slots);
+		if (*slot)
+			goto frag_alloc_found;
+		brelse(bh);
+	}
+
+	bno = pnl_alloc_block(sb, goal);
+	if (bno < 0)
+		goto frag_alloc_out;
+	/* the block may hold the data of a previously deleted file */
+	bh = sb_getblk(sb, bno);
+	lock_buffer(bh);
+	memset(bh->b_data, 0, PNLFS_BLOCK_SIZE);
+	hdr = (struct pnlfs_frag_header *) bh->b_data;
+	hdr->magic = cpu_to_le32(PNLFS_FRAG_MAGIC);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	used = 1;
+	*slot = 1;
+
+frag_alloc_found:
+	used |= pnl_frag_mask(*slot, nr_slots);
+	hdr->used = cpu_to_le32(used);
+	mark_buffer_dirty(bh);
+	brelse(bh);
+	if (pnl_frag_find(used, 1))
+		pnl_frag_remember(sb_info, bno);
+	else
+		pnl_frag_forget(sb_info, bno);
+frag_alloc_out:
+	mutex_unlock(&sb_info->frag_lock);
+	return bno;
+}
+
+/* Frees a fragment, along with its block once it was the last one */
+void pnl_frag_free(struct super_block *sb, uint32_t bno, uint32_t slot,
+		uint32_t nr_slots)
+{
+	struct pnlfs_sb_info *sb_info;
+	struct pnlfs_frag_header *hdr;
+	struct buffer_head *bh;
+	uint32_t used;
+
+	if (!slot || !nr_slots || slot + nr_slots > PNLFS_FRAGS_PER_BLOCK) {
+		pr_warn("[pnlfs] %s : bad fragment %d:%d+%d\n", __func__, bno,
+				slot, nr_slots);
+		return;
+	}
+	sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+	mutex_lock(&sb_info->frag_lock);
+	bh = pnl_sb_bread(sb, bno);
+	if (!bh) {
+		pr_warn("[pnlfs] %s : error when opening block sector %d\n",
+				__func__, bno);
+		goto frag_free_out;
+	}
+	hdr = (struct pnlfs_frag_header *) bh->b_data;
+	if (le32_to_cpu(hdr->magic) != PNLFS_FRAG_MAGIC) {
+		pr_warn("[pnlfs] %s : block %d holds no fragments\n",
+				__func__, bno);
+		brelse(bh);
+		goto frag_free_out;
+	}
+	used = le32_to_cpu(hdr->used) & ~pnl_frag_mask(slot, nr_slots);
+	if (used == 1) {
+		pnl_frag_forget(sb_info, bno);
+		bforget(bh);
+		pnl_free_block(sb, bno);
+		goto frag_free_out;
+	}
+	hdr->used = cpu_to_le32(used);
+	mark_buffer_dirty(bh);
+	brelse(bh);
+	pnl_frag_remember(sb_info, bno);
+frag_free_out:
+	mutex_unlock(&sb_info->frag_lock);
+}
+
+/*
+ * Orlov allocator, with PNLFS_FEATURE_BLOCK_GROUPS : a directory made at the
+ * root goes to the first group from a random one with more free inodes and
+ * blocks than average and no more directories than average, each starting
+ * its own subtree. Deeper, a directory stays in the first group from its
+ * parent's one which doesn't hold too many directories already and still has
+ * room for its children. Only the groups scanned up to the first one which
+ * fits are read. Returns the group to allocate the inode of a new directory
+ * from.
+ */
+static uint32_t pnl_find_dir_group(struct super_block *sb, uint32_t parent)
+{
+	struct pnlfs_sb_info *sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+	uint32_t ngroups = sb_info->nr_groups;
+	uint32_t ipg = sb_info->inodes_per_group;
+	uint32_t bpg = sb_info->blocks_per_group;
+	uint32_t avefreei, avefreeb, avedirs, max_dirs, min_inodes, min_blocks;
+	uint32_t pg, start, g, i;
+	struct pnl_group *grp;
+
+	pg = parent / ipg;
+	if (ngroups == 1)
+		return 0;
+	avefreei = div_u64(percpu_counter_read_positive(&sb_info->free_inodes),
+			ngroups);
+	avefreeb = div_u64(percpu_counter_read_positive(&sb_info->free_blocks),
+			ngroups);
+	avedirs = div_u64(percpu_counter_read_positive(&sb_info->nr_dirs),
+			ngroups);
+
+	if (!parent) {
+		start = prandom_u32() % ngroups;
+		max_dirs = avedirs + 1;
+		min_inodes = avefreei;
+		min_blocks = avefreeb;
+	} else {
+		start = pg;
+		max_dirs = avedirs + ipg / 16;
+		min_inodes = avefreei > ipg / 4 ? avefreei - ipg / 4 : 1;
+		min_blocks = avefreeb > bpg / 4 ? avefreeb - bpg / 4 : 1;
+	}
+	for (i = 0; i < ngroups; i++) {
+		g = (start + i) % ngroups;
+		grp = pnl_get_group(sb, g);
+		if (IS_ERR(grp))
+			continue;
+		if (atomic_read(&grp->nr_dirs) < max_dirs &&
+		    atomic_read(&grp->free_inodes) >= min_inodes &&
+		    atomic_read(&grp->free_blocks) >= min_blocks)
+			return g;
+	}
+
+	/* the disk is nearly full, any group with free inodes will do */
+	for (i = 0; i < ngroups; i++) {
+		g = (pg + i) % ngroups;
+		grp = pnl_get_group(sb, g);
+		if (!IS_ERR(grp) && atomic_read(&grp->free_inodes) > 0)
+			return g;
+	}
+	return pg;
+}
+
+/* Counts a directory made or removed in the group of ino */
+static void pnl_count_dir(struct super_block *sb, uint32_t ino, int delta)
+{
+	struct pnlfs_sb_info *sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+	struct pnl_group *grp;
+
+	if (!(sb_info->features & PNLFS_FEATURE_BLOCK_GROUPS))
+		return;
+	grp = pnl_get_group(sb, ino / sb_info->inodes_per_group);
+	if (IS_ERR(grp))
+		return;
+	atomic_add(delta, &grp->nr_dirs);
+	percpu_counter_add(&sb_info->nr_dirs, delta);
+	pnl_group_dirty(sb, grp);
+}
+
+/*
+ * Allocates the first free inode from goal onwards, the parent's one, so that
+ * a file lands in the group of its directory. A directory goes to the group
+ * given by pnl_find_dir_group() instead.
+ */
+int pnl_alloc_ino(struct super_block *sb, uint32_t goal, int dir)
+{
+	struct pnlfs_sb_info *sb_info;
+	int ino;
+
+	sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+	if (goal >= sb_info->nr_inodes)
+		goal = 0;
+	if (dir && (sb_info->features & PNLFS_FEATURE_BLOCK_GROUPS))
+		goal = pnl_find_dir_group(sb, goal) *
+			sb_info->inodes_per_group;
+	ino = pnl_alloc_bit(sb, goal / sb_info->inodes_per_group, 1,
+			goal % sb_info->inodes_per_group);
+	if (ino < 0) {
+		pr_warn("[pnlfs] %s : no more inodes to allocate\n",
+				__func__);
+		return ino;
+	}
+	pnl_stat_inc(sb, PNL_STAT_INODE_ALLOCS);
+	if (dir)
+		pnl_count_dir(sb, ino, 1);
+	return ino;
+}
+
+void pnl_free_ino(struct super_block *sb, uint32_t ino, int dir)
+{
+	struct pnlfs_sb_info *sb_info;
+	struct pnl_group *grp;
+
+	sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+	if (ino >= sb_info->nr_inodes) {
+		pr_warn("[pnlfs] %s : freeing inode %d out of the disk\n",
+				__func__, ino);
+		return;
+	}
+	if (dir)
+		pnl_count_dir(sb, ino, -1);
+	grp = pnl_get_group(sb, ino / sb_info->inodes_per_group);
+	if (IS_ERR(grp))
+		return;
+	pnl_group_free(sb, grp, 1, ino - grp->first_ino);
+}
+
+/* Returns the first block of the group of ino, where its blocks go */
+uint32_t pnl_ino_goal(struct super_block *sb, uint32_t ino)
+{
+	struct pnlfs_sb_info *sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+
+	if (!(sb_info->features & PNLFS_FEATURE_BLOCK_GROUPS))
+		return 0;
+	return ino / sb_info->inodes_per_group * sb_info->blocks_per_group;
+}
+
+/* Returns the block of the inode table holding ino, and its offset there */
+int pnl_inode_block(struct super_block *sb, uint32_t ino, uint32_t *offset)
+{
+	struct pnlfs_sb_info *sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+	struct pnl_group *grp;
+
+	if (ino >= sb_info->nr_inodes) {
+		pr_warn("[pnlfs] %s : inode %d out of the disk\n", __func__,
+				ino);
+		return -EINVAL;
+	}
+	grp = pnl_get_group(sb, ino / sb_info->inodes_per_group);
+	if (IS_ERR(grp))
+		return PTR_ERR(grp);
+	ino -= grp->first_ino;
+	*offset = (ino % sb_info->inodes_per_block) * sb_info->inode_size;
+	return grp->inode_table + ino / sb_info->inodes_per_block;
+}
+
+/*
+ * Counts the runs of free blocks of each group and the largest one, a run
+ * going over the end of a group counting as two.
+ */
+int pnl_free_extents(struct super_block *sb, struct pnl_free_extents *fe)
+{
+	struct pnlfs_sb_info *sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+	struct pnl_group *grp;
+	struct buffer_head *bh;
+	unsigned long start, end;
+	uint32_t g;
+
+	memset(fe, 0, sizeof(struct pnl_free_extents));
+	for (g = 0; g < sb_info->nr_groups; g++) {
+		grp = pnl_get_group(sb, g);
+		if (IS_ERR(grp))
+			return PTR_ERR(grp);
+		if (atomic_read(&grp->free_blocks) <= 0)
+			continue;
+		bh = pnl_group_bitmap(sb, grp, 0);
+		if (IS_ERR(bh))
+			return PTR_ERR(bh);
+		for (start = find_next_bit_le(bh->b_data, grp->nr_blocks, 0);
+		     start < grp->nr_blocks;
+		     start = find_next_bit_le(bh->b_data, grp->nr_blocks,
+				     end)) {
+			end = find_next_zero_bit_le(bh->b_data,
+					grp->nr_blocks, start);
+			fe->nr_extents++;
+			fe->nr_free += end - start;
+			fe->largest = max_t(uint32_t, fe->largest,
+					end - start);
+		}
+		brelse(bh);
+		cond_resched();
+	}
+	return 0;
+}
+
+/* Returns a reference to a bitmap of grp, NULL if it isn't held */
+static struct buffer_head *pnl_group_held(struct pnl_group *grp,
+		struct buffer_head **slot)
+{
+	struct buffer_head *bh;
+
+	spin_lock(&grp->lock);
+	bh = *slot;
+	if (bh)
+		get_bh(bh);
+	spin_unlock(&grp->lock);
+	return bh;
+}
+
+/*
+ * Copies the counts of the groups changed since the last sync to their
+ * descriptors, then writes their bitmaps and descriptors in one batch and
+ * waits for all of them. Without wait, the descriptors are left to the
+ * flusher, and the groups stay queued for the waiting sync which follows.
+ */
+int pnl_alloc_sync(struct super_block *sb, int wait)
+{
+	struct pnlfs_sb_info *sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+	struct pnl_group **grps, *grp;
+	struct buffer_head **bhs = NULL, *bh;
+	uint32_t nr, i, nr_bhs = 0;
+	int err = 0;
+
+	if (!sb_info->nr_dirty_groups)
+		return 0;
+	nr = sb_info->nr_dirty_groups;
+	grps = kmalloc_array(nr, sizeof(struct pnl_group *), GFP_NOFS);
+	if (wait)
+		bhs = kmalloc_array(nr * 3, sizeof(struct buffer_head *),
+				GFP_NOFS);
+	if (!grps || (wait && !bhs)) {
+		err = -ENOMEM;
+		goto alloc_sync_out;
+	}
+
+	/* with wait, the groups changed from now on go to the next sync */
+	spin_lock(&sb_info->dirty_lock);
+	i = 0;
+	list_for_each_entry(grp, &sb_info->dirty_groups, dirty) {
+		if (i == nr)
+			break;
+		grps[i++] = grp;
+	}
+	for (nr = i, i = 0; wait && i < nr; i++) {
+		list_del_init(&grps[i]->dirty);
+		clear_bit(PNL_GROUP_DIRTY, &grps[i]->state);
+		sb_info->nr_dirty_groups--;
+	}
+	spin_unlock(&sb_info->dirty_lock);
+
+	/* the groups are only freed at unmount, they outlive the lock */
+	for (i = 0; i < nr; i++)
+		if (pnl_group_update(sb, grps[i]))
+			err = -EIO;
+	if (!wait)
+		goto alloc_sync_out;
+
+	for (i = 0; i < nr; i++) {
+		grp = grps[i];
+		bh = pnl_group_held(grp, &grp->bfree_bh);
+		if (bh)
+			bhs[nr_bhs++] = bh;
+		bh = pnl_group_held(grp, &grp->ifree_bh);
+		if (bh)
+			bhs[nr_bhs++] = bh;
+		if (!(sb_info->features & PNLFS_FEATURE_BLOCK_GROUPS))
+			continue;
+		bh = pnl_sb_bread(sb, PNLFS_GDT_BLOCK_NR +
+				grp->nr / PNLFS_DESCS_PER_BLOCK);
+		if (bh)
+			bhs[nr_bhs++] = bh;
+		else
+			err = -EIO;
+	}
+	/* a descriptor block shared by several groups is only written once */
+	for (i = 0; i < nr_bhs; i++)
+		write_dirty_buffer(bhs[i], 0);
+	for (i = 0; i < nr_bhs; i++) {
+		wait_on_buffer(bhs[i]);
+		if (!buffer_uptodate(bhs[i]))
+			err = -EIO;
+		brelse(bhs[i]);
+	}
+alloc_sync_out:
+	kfree(grps);
+	kfree(bhs);
+	return err;
+}
+
+/* Drops the reference of grp to a bitmap, unless it is dirty or in use */
+static int pnl_release_bitmap(struct pnl_group *grp, struct buffer_head **slot)
+{
+	struct buffer_head *bh;
+
+	spin_lock(&grp->lock);
+	bh = *slot;
+	if (!bh || atomic_read(&bh->b_count) > 1 || buffer_dirty(bh) ||
+			buffer_locked(bh)) {
+		spin_unlock(&grp->lock);
+		return 0;
+	}
+	*slot = NULL;
+	spin_unlock(&grp->lock);
+	brelse(bh);
+	return 1;
+}
+
+static unsigned long pnl_count_bitmaps(struct shrinker *shrink,
+		struct shrink_control *sc)
+{
+	struct pnlfs_sb_info *sb_info;
+
+	sb_info = container_of(shrink, struct pnlfs_sb_info, shrinker);
+	return atomic_read(&sb_info->nr_bitmaps);
+}
+
+/* Goes on over the groups from where the previous scan stopped */
+static unsigned long pnl_scan_bitmaps(struct shrinker *shrink,
+		struct shrink_control *sc)
+{
+	struct pnlfs_sb_info *sb_info;
+	struct pnl_group *grp;
+	unsigned long freed = 0;
+	uint32_t g, i;
+	int n;
+
+	sb_info = container_of(shrink, struct pnlfs_sb_info, shrinker);
+	g = sb_info->shrink_next;
+	for (i = 0; i < sb_info->nr_groups && freed < sc->nr_to_scan; i++) {
+		grp = READ_ONCE(sb_info->groups[g]);
+		if (grp) {
+			n = pnl_release_bitmap(grp, &grp->bfree_bh) +
+				pnl_release_bitmap(grp, &grp->ifree_bh);
+			atomic_sub(n, &sb_info->nr_bitmaps);
+			freed += n;
+		}
+		if (++g >= sb_info->nr_groups)
+			g = 0;
+	}
+	sb_info->shrink_next = g;
+	return freed;
+}
+
+/*
+ * Starts reading in one batch the blocks pnl_count_disk() goes through: the
+ * descriptors of the block groups, or else the whole global bitmaps.
+ */
+static void pnl_alloc_readahead(struct super_block *sb)
+{
+	struct pnlfs_sb_info *sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+	struct blk_plug plug;
+	uint32_t first, nr, i;
+
+	if (sb_info->features & PNLFS_FEATURE_BLOCK_GROUPS) {
+		first = PNLFS_GDT_BLOCK_NR;
+		nr = DIV_ROUND_UP(sb_info->nr_groups, PNLFS_DESCS_PER_BLOCK);
+	} else {
+		first = PNLFS_ISTORE_NR + sb_info->nr_istore_blocks;
+		nr = sb_info->nr_ifree_blocks + sb_info->nr_bfree_blocks;
+	}
+	blk_start_plug(&plug);
+	for (i = 0; i < nr; i++)
+		sb_breadahead(sb, first + i);
+	blk_finish_plug(&plug);
+}
+
+/* Counts the free bits of the global bitmap starting at block first */
+static int pnl_count_bitmap(struct super_block *sb, uint32_t first,
+		uint32_t nr_blocks, uint32_t nr_bits, s64 *count)
+{
+	struct buffer_head *bh;
+	uint32_t i;
+
+	*count = 0;
+	for (i = 0; i < nr_blocks && i * PNLFS_BITS_PER_BLOCK < nr_bits; i++) {
+		bh = pnl_sb_bread(sb, first + i);
+		if (!bh) {
+			pr_warn("[pnlfs] %s : error when opening block sector %d\n",
+					__func__, first + i);
+			return -EIO;
+		}
+		*count += pnl_count_free(bh, min_t(uint32_t,
+				PNLFS_BITS_PER_BLOCK,
+				nr_bits - i * PNLFS_BITS_PER_BLOCK));
+		brelse(bh);
+	}
+	return 0;
+}
+
+/*
+ * Counts the free blocks and inodes of the disk, from the descriptors of the
+ * block groups, or else from the global bitmaps. The counts the superblock
+ * holds are only written back for the tools and never trusted. Directories
+ * are only counted with block groups.
+ */
+static int pnl_count_disk(struct super_block *sb, s64 *free_blocks,
+		s64 *free_inodes, s64 *nr_dirs)
+{
+	struct pnlfs_sb_info *sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+	struct pnlfs_group_desc *desc;
+	struct buffer_head *bh;
+	uint32_t g, bno, i;
+	int err;
+
+	*nr_dirs = 0;
+	pnl_alloc_readahead(sb);
+	if (!(sb_info->features & PNLFS_FEATURE_BLOCK_GROUPS)) {
+		bno = PNLFS_ISTORE_NR + sb_info->nr_istore_blocks;
+		err = pnl_count_bitmap(sb, bno, sb_info->nr_ifree_blocks,
+				sb_info->nr_inodes, free_inodes);
+		if (!err)
+			err = pnl_count_bitmap(sb,
+					bno + sb_info->nr_ifree_blocks,
+					sb_info->nr_bfree_blocks,
+					sb_info->nr_blocks, free_blocks);
+		return err;
+	}
+
+	*free_blocks = 0;
+	*free_inodes = 0;
+	for (g = 0; g < sb_info->nr_groups; g += PNLFS_DESCS_PER_BLOCK) {
+		bno = PNLFS_GDT_BLOCK_NR + g / PNLFS_DESCS_PER_BLOCK;
+		bh = pnl_sb_bread(sb, bno);
+		if (!bh) {
+			pr_warn("[pnlfs] %s : error when opening block sector %d\n",
+					__func__, bno);
+			return -EIO;
+		}
+		desc = (struct pnlfs_group_desc *) bh->b_data;
+		for (i = 0; i < PNLFS_DESCS_PER_BLOCK &&
+			    g + i < sb_info->nr_groups; i++) {
+			*free_blocks += le32_to_cpu(desc[i].nr_free_blocks);
+			*free_inodes += le32_to_cpu(desc[i].nr_free_inodes);
+			*nr_dirs += le32_to_cpu(desc[i].nr_dirs);
+		}
+		brelse(bh);
+	}
+	return 0;
+}
+
+static void pnl_alloc_free(struct super_block *sb)
+{
+	struct pnlfs_sb_info *sb_info;
+	uint32_t g;
+
+	sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+	if (sb_info->groups) {
+		for (g = 0; g < sb_info->nr_groups; g++)
+			if (sb_info->groups[g])
+				pnl_put_group(sb, sb_info->groups[g]);
+		vfree(sb_info->groups);
+		sb_info->groups = NULL;
+	}
+	free_percpu(sb_info->block_hint);
+	sb_info->block_hint = NULL;
+	percpu_counter_destroy(&sb_info->free_blocks);
+	percpu_counter_destroy(&sb_info->free_inodes);
+	percpu_counter_destroy(&sb_info->nr_dirs);
+}
+
+/*
+ * Sets the allocator up once the geometry of the disk is known. The groups
+ * are read on first use, only the free counts of the whole disk are counted
+ * here.
+ */
+int pnl_alloc_init(struct super_block *sb)
+{
+	struct pnlfs_sb_info *sb_info;
+	s64 free_blocks, free_inodes, nr_dirs;
+	int cpu, err;
+
+	sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+	err = pnl_count_disk(sb, &free_blocks, &free_inodes, &nr_dirs);
+	if (err)
+		return err;
+	err = percpu_counter_init(&sb_info->free_blocks,
+			min_t(s64, free_blocks, sb_info->nr_blocks), GFP_KERNEL);
+	if (!err)
+		err = percpu_counter_init(&sb_info->free_inodes,
+				min_t(s64, free_inodes, sb_info->nr_inodes),
+				GFP_KERNEL);
+	if (!err)
+		err = percpu_counter_init(&sb_info->nr_dirs,
+				min_t(s64, nr_dirs, sb_info->nr_inodes),
+				GFP_KERNEL);
+	if (err) {
+		pnl_alloc_free(sb);
+		return err;
+	}
+	atomic_set(&sb_info->nr_bitmaps, 0);
+	sb_info->shrink_next = 0;
+	spin_lock_init(&sb_info->dirty_lock);
+	INIT_LIST_HEAD(&sb_info->dirty_groups);
+	sb_info->nr_dirty_groups = 0;
+	mutex_init(&sb_info->frag_lock);
+	sb_info->nr_frag_blocks = 0;
+	sb_info->groups = vzalloc(sb_info->nr_groups *
+			sizeof(struct pnl_group *));
+	sb_info->block_hint = alloc_percpu(uint32_t);
+	if (!sb_info->groups || !sb_info->block_hint) {
+		pnl_alloc_free(sb);
+		return -ENOMEM;
+	}
+	/* CPUs start allocating evenly spaced over the disk */
+	for_each_possible_cpu(cpu)
+		*per_cpu_ptr(sb_info->block_hint, cpu) =
+			div_u64((uint64_t) sb_info->nr_blocks * cpu,
+				nr_cpu_ids);
+
+	sb_info->shrinker.count_objects = pnl_count_bitmaps;
+	sb_info->shrinker.scan_objects = pnl_scan_bitmaps;
+	sb_info->shrinker.seeks = DEFAULT_SEEKS;
+	sb_info->shrinker.batch = 0;
+	err = register_shrinker(&sb_info->shrinker);
+	if (err) {
+		pnl_alloc_free(sb);
+		return err;
+	}
+	return 0;
+}
+
+void pnl_alloc_destroy(struct super_block *sb)
+{
+	struct pnlfs_sb_info *sb_info;
+
+	sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+	unregister_shrinker(&sb_info->shrinker);
+	pnl_alloc_free(sb);
+}
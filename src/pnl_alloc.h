@@ -0,0 +1,56 @@
+#ifndef _PNL_ALLOC_H
+#define _PNL_ALLOC_H
+
+#include <linux/spinlock.h>
+#include "pnlfs.h"
+
+/*
+ * A group of blocks and inodes along with their bitmaps. Without
+ * PNLFS_FEATURE_BLOCK_GROUPS, each block of the global bitmaps makes a group.
+ */
+struct pnl_group {
+	spinlock_t lock;          /* Serializes the descriptor updates */
+	uint32_t nr;
+	uint32_t first_block;
+	uint32_t nr_blocks;
+	uint32_t first_ino;
+	uint32_t nr_inodes;
+	uint32_t block_bitmap;    /* Block of the bfree bitmap */
+	uint32_t inode_bitmap;    /* Block of the ifree bitmap */
+	uint32_t inode_table;     /* First block of the inode table */
+	atomic_t free_blocks;
+	atomic_t free_inodes;
+	atomic_t nr_dirs;         /* Only with PNLFS_FEATURE_BLOCK_GROUPS */
+	struct buffer_head *bfree_bh; /* Bitmaps, NULL until used */
+	struct buffer_head *ifree_bh;
+	unsigned long state;      /* PNL_GROUP_* bits */
+	struct list_head dirty;   /* In sb_info->dirty_groups */
+};
+
+#define PNL_GROUP_DIRTY       0   /* Changed since the last sync */
+
+/* Free space of the disk, see pnl_free_extents() */
+struct pnl_free_extents {
+	uint64_t nr_free;
+	uint64_t nr_extents;      /* Runs of free blocks */
+	uint32_t largest;
+};
+
+int pnl_alloc_init(struct super_block *sb);
+void pnl_alloc_destroy(struct super_block *sb);
+struct pnl_group *pnl_get_group(struct super_block *sb, uint32_t g);
+int pnl_inode_block(struct super_block *sb, uint32_t ino, uint32_t *offset);
+uint32_t pnl_ino_goal(struct super_block *sb, uint32_t ino);
+int pnl_alloc_block(struct super_block *sb, uint32_t goal);
+int pnl_alloc_blocks(struct super_block *sb, uint32_t goal, uint32_t *count);
+void pnl_free_block(struct super_block *sb, uint32_t bno);
+int pnl_alloc_ino(struct super_block *sb, uint32_t goal, int dir);
+void pnl_free_ino(struct super_block *sb, uint32_t ino, int dir);
+int pnl_frag_alloc(struct super_block *sb, uint32_t goal, uint32_t nr_slots,
+		uint32_t *slot);
+void pnl_frag_free(struct super_block *sb, uint32_t bno, uint32_t slot,
+		uint32_t nr_slots);
+int pnl_alloc_sync(struct super_block *sb, int wait);
+int pnl_free_extents(struct super_block *sb, struct pnl_free_extents *fe);
+
+#endif
@@ -0,0 +1,723 @@
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/log2.h>
+#include <linux/rwsem.h>
+#include <linux/slab.h>
+#include <uapi/linux/stat.h>
+#include <uapi/asm-generic/errno-base.h>
+#include <uapi/asm-generic/errno.h>
+#include "pnlfs.h"
+#include "pnl_stats.h"
+#include "pnl_ifops.h"
+#include "pnl_alloc.h"
+#include "pnl_dir.h"
+
+/*
+ * Entries of a directory are indexed in memory by name on the first lookup,
+ * along with their location, so that lookups don't have to read and compare
+ * the directory blocks anymore. The index is kept up to date by every change
+ * of the directory once built.
+ */
+struct pnl_dir_entry {
+	struct hlist_node node;
+	uint32_t hash;
+	uint32_t ino;
+	struct pnl_dir_pos pos;
+	uint32_t len;
+	char name[PNLFS_FILENAME_LEN];
+};
+
+struct pnl_dir_cache {
+	uint32_t bits;            /* log2 of the number of heads */
+	uint32_t nr_entries;
+	struct hlist_head heads[];
+};
+
+#define PNL_DIR_CACHE_MIN_BITS       4
+#define PNL_DIR_CACHE_MAX_BITS       18
+
+/* FNV-1a, names are hashed the same way on every host */
+uint32_t pnl_dir_hash(const char *name, int len)
+{
+	uint32_t hash = 2166136261U;
+
+	while (len--) {
+		hash ^= (unsigned char) *name++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static bool pnl_dir_indexed(struct inode *dir)
+{
+	struct pnlfs_sb_info *sb_info;
+
+	sb_info = (struct pnlfs_sb_info *) dir->i_sb->s_fs_info;
+	return sb_info->features & PNLFS_FEATURE_DIR_INDEX;
+}
+
+static bool pnl_dir_inline(struct inode *dir)
+{
+	struct pnlfs_inode_info *i_info;
+
+	i_info = container_of(dir, struct pnlfs_inode_info, vfs_inode);
+	return i_info->flags & PNLFS_INODE_INLINE;
+}
+
+uint32_t pnl_dir_nr_blocks(struct inode *dir)
+{
+	if (!pnl_dir_indexed(dir) || dir->i_size < PNLFS_BLOCK_SIZE)
+		return 1;
+	return dir->i_size / PNLFS_BLOCK_SIZE;
+}
+
+/* Number of blocks the index of a directory can map */
+static uint32_t pnl_dir_max_blocks(struct inode *dir)
+{
+	struct pnlfs_sb_info *sb_info;
+
+	sb_info = (struct pnlfs_sb_info *) dir->i_sb->s_fs_info;
+	if (sb_info->features & PNLFS_FEATURE_INDIRECT)
+		return PNLFS_MAX_INDIRECT_FILESIZE / PNLFS_BLOCK_SIZE;
+	return PNLFS_INDEX_ENTRIES;
+}
+
+/*
+ * Linear hashing : with nr_blocks between 2^n and 2^(n+1), the first
+ * nr_blocks - 2^n blocks have already been split on n + 1 bits of the hash.
+ */
+static uint32_t pnl_dir_bucket(uint32_t hash, uint32_t nr_blocks)
+{
+	uint32_t level = 1U << ilog2(nr_blocks);
+	uint32_t block = hash & (level - 1);
+
+	if (block < nr_blocks - level)
+		block = hash & ((level << 1) - 1);
+	return block;
+}
+
+/*
+ * Reads a block of a directory, NULL is returned for a block of a hashed
+ * directory that never held an entry.
+ */
+static struct buffer_head *pnl_dir_bread(struct inode *dir, uint32_t block)
+{
+	struct pnlfs_inode_info *i_info;
+	struct buffer_head *bh;
+	int bno;
+
+	i_info = container_of(dir, struct pnlfs_inode_info, vfs_inode);
+	if (pnl_dir_indexed(dir)) {
+		bno = pnl_map_block(dir, block, 0, NULL);
+		if (bno < 0)
+			return ERR_PTR(bno);
+		if (!bno)
+			return NULL;
+	} else {
+		bno = i_info->index_block;
+	}
+	bh = pnl_sb_bread(dir->i_sb, bno);
+	if (!bh) {
+		pr_warn("[pnlfs] %s : error when opening block sector %d\n",
+				__func__, bno);
+		return ERR_PTR(-EIO);
+	}
+	return bh;
+}
+
+/* Starts reading a block of a directory ahead of its use */
+void pnl_dir_readahead(struct inode *dir, uint32_t block)
+{
+	int bno;
+
+	if (!pnl_dir_indexed(dir) || pnl_dir_inline(dir) ||
+			block >= pnl_dir_nr_blocks(dir))
+		return;
+	bno = pnl_map_block(dir, block, 0, NULL);
+	if (bno > 0)
+		sb_breadahead(dir->i_sb, bno);
+}
+
+/* Same as pnl_dir_bread(), allocating a zeroed block if needed */
+static struct buffer_head *pnl_dir_bread_new(struct inode *dir,
+		uint32_t block)
+{
+	struct buffer_head *bh;
+	int bno, new = 0;
+
+	if (!pnl_dir_indexed(dir))
+		return pnl_dir_bread(dir, block);
+	bno = pnl_map_block(dir, block, 1, &new);
+	if (bno < 0)
+		return ERR_PTR(bno);
+	if (!new)
+		return pnl_dir_bread(dir, block);
+	bh = sb_getblk(dir->i_sb, bno);
+	if (!bh)
+		return ERR_PTR(-ENOMEM);
+	lock_buffer(bh);
+	memset(bh->b_data, 0, PNLFS_BLOCK_SIZE);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty_inode(bh, dir);
+	return bh;
+}
+
+/*
+ * Gets the entries of a block of a directory, allocating the block if create
+ * is set. An inline directory is a single block of PNLFS_INLINE_DIR_ENTRIES
+ * entries, a block of a hashed directory that never held an entry has none.
+ */
+int pnl_dir_get(struct inode *dir, uint32_t block, int create,
+		struct pnl_dir_view *view)
+{
+	struct pnlfs_inode_info *i_info;
+	struct buffer_head *bh;
+
+	i_info = container_of(dir, struct pnlfs_inode_info, vfs_inode);
+	if (pnl_dir_inline(dir)) {
+		view->bh = NULL;
+		view->files = (struct pnlfs_file *) i_info->i_data;
+		view->nr_files = PNLFS_INLINE_DIR_ENTRIES;
+		return 0;
+	}
+	bh = create ? pnl_dir_bread_new(dir, block) : pnl_dir_bread(dir, block);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	view->bh = bh;
+	view->files = NULL;
+	view->nr_files = 0;
+	if (bh) {
+		view->files = ((struct pnlfs_dir_block *) bh->b_data)->files;
+		view->nr_files = PNLFS_MAX_DIR_ENTRIES;
+	}
+	return 0;
+}
+
+/* Releases the entries got by pnl_dir_get(), writing them if dirty is set */
+void pnl_dir_put(struct inode *dir, struct pnl_dir_view *view, int dirty)
+{
+	if (dirty) {
+		if (view->bh)
+			mark_buffer_dirty_inode(view->bh, dir);
+		else
+			mark_inode_dirty(dir);
+	}
+	brelse(view->bh);
+}
+
+static bool pnl_dir_filetype(struct super_block *sb)
+{
+	struct pnlfs_sb_info *sb_info;
+
+	sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+	return sb_info->features & PNLFS_FEATURE_FILETYPE;
+}
+
+/* Longest name an entry can hold */
+uint32_t pnl_dir_name_len(struct super_block *sb)
+{
+	if (pnl_dir_filetype(sb))
+		return PNLFS_FILENAME_LEN - 1;
+	return PNLFS_FILENAME_LEN;
+}
+
+int pnl_dir_entry_len(struct super_block *sb, struct pnlfs_file *file)
+{
+	return strnlen(file->filename, pnl_dir_name_len(sb));
+}
+
+/* DT_ type of an entry, as given to dir_emit() */
+unsigned char pnl_dir_entry_type(struct super_block *sb,
+		struct pnlfs_file *file)
+{
+	if (!pnl_dir_filetype(sb))
+		return DT_UNKNOWN;
+	return file->filename[PNLFS_FILENAME_LEN - 1];
+}
+
+/* Points an entry to inode, its name is left as is */
+static void pnl_dir_set(struct super_block *sb, struct pnlfs_file *file,
+		struct inode *inode)
+{
+	file->inode = cpu_to_le32(inode->i_ino);
+	if (pnl_dir_filetype(sb))
+		file->filename[PNLFS_FILENAME_LEN - 1] =
+			(inode->i_mode & S_IFMT) >> 12;
+}
+
+static void pnl_dir_fill(struct super_block *sb, struct pnlfs_file *file,
+		const struct qstr *name, struct inode *inode)
+{
+	memset(file->filename, 0, PNLFS_FILENAME_LEN);
+	memcpy(file->filename, name->name, name->len);
+	pnl_dir_set(sb, file, inode);
+}
+
+static bool pnl_dir_match(struct super_block *sb, struct pnlfs_file *file,
+		const char *name, int len)
+{
+	return file->inode && pnl_dir_entry_len(sb, file) == len &&
+		!memcmp(file->filename, name, len);
+}
+
+static struct pnl_dir_cache *pnl_dir_cache_alloc(uint32_t bits)
+{
+	struct pnl_dir_cache *cache;
+	uint32_t i;
+
+	cache = kmalloc(sizeof(struct pnl_dir_cache) +
+			(sizeof(struct hlist_head) << bits), GFP_NOFS);
+	if (!cache)
+		return NULL;
+	cache->bits = bits;
+	cache->nr_entries = 0;
+	for (i = 0; i < (1U << bits); i++)
+		INIT_HLIST_HEAD(&cache->heads[i]);
+	return cache;
+}
+
+static struct hlist_head *pnl_dir_cache_head(struct pnl_dir_cache *cache,
+		uint32_t hash)
+{
+	return &cache->heads[hash & ((1U << cache->bits) - 1)];
+}
+
+/* scanned, if not NULL, is increased by the number of entries compared */
+static struct pnl_dir_entry *pnl_dir_cache_find(struct pnl_dir_cache *cache,
+		const char *name, int len, uint32_t hash, uint32_t *scanned)
+{
+	struct pnl_dir_entry *de;
+
+	hlist_for_each_entry(de, pnl_dir_cache_head(cache, hash), node) {
+		if (scanned)
+			(*scanned)++;
+		if (de->hash == hash && de->len == len &&
+				!memcmp(de->name, name, len))
+			return de;
+	}
+	return NULL;
+}
+
+/* Doubles the number of heads, the cache is left as is on failure */
+static void pnl_dir_cache_grow(struct pnlfs_inode_info *i_info)
+{
+	struct pnl_dir_cache *cache = i_info->dir_cache, *new;
+	struct pnl_dir_entry *de;
+	struct hlist_node *tmp;
+	uint32_t i;
+
+	new = pnl_dir_cache_alloc(cache->bits + 1);
+	if (!new)
+		return;
+	for (i = 0; i < (1U << cache->bits); i++) {
+		hlist_for_each_entry_safe(de, tmp, &cache->heads[i], node) {
+			hlist_del(&de->node);
+			hlist_add_head(&de->node,
+					pnl_dir_cache_head(new, de->hash));
+		}
+	}
+	new->nr_entries = cache->nr_entries;
+	kfree(cache);
+	i_info->dir_cache = new;
+}
+
+static int pnl_dir_cache_add(struct pnlfs_inode_info *i_info,
+		const char *name, int len, uint32_t hash, ino_t ino,
+		const struct pnl_dir_pos *pos)
+{
+	struct pnl_dir_cache *cache = i_info->dir_cache;
+	struct pnl_dir_entry *de;
+
+	if (cache->bits < PNL_DIR_CACHE_MAX_BITS &&
+			cache->nr_entries >= (2U << cache->bits)) {
+		pnl_dir_cache_grow(i_info);
+		cache = i_info->dir_cache;
+	}
+	de = kmalloc(sizeof(struct pnl_dir_entry), GFP_NOFS);
+	if (!de)
+		return -ENOMEM;
+	de->hash = hash;
+	de->ino = ino;
+	de->pos = *pos;
+	de->len = len;
+	memcpy(de->name, name, len);
+	hlist_add_head(&de->node, pnl_dir_cache_head(cache, hash));
+	cache->nr_entries++;
+	return 0;
+}
+
+void pnl_dir_drop_cache(struct pnlfs_inode_info *i_info)
+{
+	struct pnl_dir_cache *cache = i_info->dir_cache;
+	struct pnl_dir_entry *de;
+	struct hlist_node *tmp;
+	uint32_t i;
+
+	if (!cache)
+		return;
+	for (i = 0; i < (1U << cache->bits); i++) {
+		hlist_for_each_entry_safe(de, tmp, &cache->heads[i], node) {
+			hlist_del(&de->node);
+			kfree(de);
+		}
+	}
+	kfree(cache);
+	i_info->dir_cache = NULL;
+}
+
+/* Reads the whole directory into a new cache, caller holds dir_sem */
+static int pnl_dir_cache_build(struct inode *dir)
+{
+	struct pnlfs_inode_info *i_info;
+	struct pnl_dir_view view;
+	struct pnlfs_file *file;
+	struct pnl_dir_pos pos;
+	uint32_t bits = PNL_DIR_CACHE_MIN_BITS, nr_blocks;
+	int len, ret;
+
+	i_info = container_of(dir, struct pnlfs_inode_info, vfs_inode);
+	while (bits < PNL_DIR_CACHE_MAX_BITS &&
+			(1U << bits) < i_info->nr_entries)
+		bits++;
+	i_info->dir_cache = pnl_dir_cache_alloc(bits);
+	if (!i_info->dir_cache)
+		return -ENOMEM;
+
+	nr_blocks = pnl_dir_nr_blocks(dir);
+	for (pos.block = 0; pos.block < nr_blocks; pos.block++) {
+		pnl_dir_readahead(dir, pos.block + 1);
+		ret = pnl_dir_get(dir, pos.block, 0, &view);
+		if (ret)
+			goto build_failed;
+		for (pos.slot = 0; pos.slot < view.nr_files; pos.slot++) {
+			file = &view.files[pos.slot];
+			if (!file->inode)
+				continue;
+			len = pnl_dir_entry_len(dir->i_sb, file);
+			ret = pnl_dir_cache_add(i_info, file->filename, len,
+					pnl_dir_hash(file->filename, len),
+					le32_to_cpu(file->inode), &pos);
+			if (ret) {
+				pnl_dir_put(dir, &view, 0);
+				goto build_failed;
+			}
+		}
+		pnl_dir_put(dir, &view, 0);
+	}
+	return 0;
+
+build_failed:
+	pnl_dir_drop_cache(i_info);
+	return ret;
+}
+
+/* Looks for an entry in its block when there is no cache */
+static int pnl_dir_search(struct inode *dir, const char *name, int len,
+		uint32_t hash, ino_t *ino, struct pnl_dir_pos *pos)
+{
+	struct pnl_dir_view view;
+	uint32_t block, slot;
+	int ret;
+
+	block = pnl_dir_bucket(hash, pnl_dir_nr_blocks(dir));
+	ret = pnl_dir_get(dir, block, 0, &view);
+	if (ret)
+		return ret;
+	for (slot = 0; slot < view.nr_files; slot++) {
+		if (pnl_dir_match(dir->i_sb, &view.files[slot], name, len)) {
+			*ino = le32_to_cpu(view.files[slot].inode);
+			if (pos) {
+				pos->block = block;
+				pos->slot = slot;
+			}
+			pnl_dir_put(dir, &view, 0);
+			pnl_stat_add(dir->i_sb, PNL_STAT_LOOKUP_SCANNED,
+					slot + 1);
+			return 0;
+		}
+	}
+	pnl_dir_put(dir, &view, 0);
+	pnl_stat_add(dir->i_sb, PNL_STAT_LOOKUP_SCANNED, view.nr_files);
+	return -ENOENT;
+}
+
+/*
+ * Looks for name in dir, returns -ENOENT if it doesn't exist. pos, if not
+ * NULL, is only valid until the next change of the directory.
+ */
+int pnl_dir_find(struct inode *dir, const struct qstr *name, ino_t *ino,
+		struct pnl_dir_pos *pos)
+{
+	struct pnlfs_inode_info *i_info;
+	struct pnl_dir_entry *de;
+	uint32_t hash, scanned = 0;
+	int ret;
+
+	i_info = container_of(dir, struct pnlfs_inode_info, vfs_inode);
+	hash = pnl_dir_hash(name->name, name->len);
+	down_read(&i_info->dir_sem);
+	if (!i_info->dir_cache) {
+		up_read(&i_info->dir_sem);
+		down_write(&i_info->dir_sem);
+		/* failing to build the cache only costs a block read */
+		if (!i_info->dir_cache)
+			pnl_dir_cache_build(dir);
+		downgrade_write(&i_info->dir_sem);
+	}
+	if (i_info->dir_cache) {
+		de = pnl_dir_cache_find(i_info->dir_cache, name->name,
+				name->len, hash, &scanned);
+		pnl_stat_add(dir->i_sb, PNL_STAT_LOOKUP_SCANNED, scanned);
+		ret = -ENOENT;
+		if (de) {
+			*ino = de->ino;
+			if (pos)
+				*pos = de->pos;
+			ret = 0;
+		}
+	} else {
+		ret = pnl_dir_search(dir, name->name, name->len, hash, ino,
+				pos);
+	}
+	up_read(&i_info->dir_sem);
+	return ret;
+}
+
+/*
+ * Splits the next block of the linear hashing into a new block appended to
+ * the directory. Only this block is read and written, so the directory is
+ * consistent after each split.
+ */
+static int pnl_dir_split(struct inode *dir)
+{
+	struct pnlfs_inode_info *i_info;
+	struct buffer_head *bh, *new_bh = NULL;
+	struct pnlfs_dir_block *dir_block, *new_block = NULL;
+	struct pnlfs_file *file;
+	struct pnl_dir_entry *de;
+	uint32_t nr_blocks, level, block, slot, hash, new_slot = 0;
+	int len;
+
+	i_info = container_of(dir, struct pnlfs_inode_info, vfs_inode);
+	nr_blocks = pnl_dir_nr_blocks(dir);
+	if (nr_blocks >= pnl_dir_max_blocks(dir))
+		return -ENOSPC;
+	level = 1U << ilog2(nr_blocks);
+	block = nr_blocks - level;
+
+	bh = pnl_dir_bread(dir, block);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	if (bh) {
+		dir_block = (struct pnlfs_dir_block *) bh->b_data;
+		for (slot = 0; slot < PNLFS_MAX_DIR_ENTRIES; slot++) {
+			file = &dir_block->files[slot];
+			if (!file->inode)
+				continue;
+			len = pnl_dir_entry_len(dir->i_sb, file);
+			hash = pnl_dir_hash(file->filename, len);
+			if ((hash & ((level << 1) - 1)) == block)
+				continue;
+			if (!new_bh) {
+				new_bh = pnl_dir_bread_new(dir, nr_blocks);
+				if (IS_ERR(new_bh)) {
+					brelse(bh);
+					return PTR_ERR(new_bh);
+				}
+				new_block = (struct pnlfs_dir_block *)
+					new_bh->b_data;
+			}
+			if (i_info->dir_cache) {
+				de = pnl_dir_cache_find(i_info->dir_cache,
+						file->filename, len, hash, NULL);
+				if (de) {
+					de->pos.block = nr_blocks;
+					de->pos.slot = new_slot;
+				}
+			}
+			new_block->files[new_slot++] = *file;
+			memset(file, 0, sizeof(struct pnlfs_file));
+		}
+		if (new_bh) {
+			mark_buffer_dirty_inode(new_bh, dir);
+			brelse(new_bh);
+			mark_buffer_dirty_inode(bh, dir);
+		}
+		brelse(bh);
+	}
+	dir->i_size = (loff_t) (nr_blocks + 1) * PNLFS_BLOCK_SIZE;
+	mark_inode_dirty(dir);
+	return 0;
+}
+
+/*
+ * Moves the entries of a full inline directory to its first block, at the
+ * same slots, mapped by a new index block when the directory is hashed.
+ * The caller holds dir_sem.
+ */
+static int pnl_dir_spill(struct inode *dir)
+{
+	struct super_block *sb = dir->i_sb;
+	struct pnlfs_inode_info *i_info;
+	struct buffer_head *bh;
+	__u8 data[PNLFS_INODE_DATA_SIZE];
+	int bno;
+
+	i_info = container_of(dir, struct pnlfs_inode_info, vfs_inode);
+	bno = pnl_new_index(sb, dir, pnl_ino_goal(sb, dir->i_ino));
+	if (bno < 0)
+		return bno;
+	spin_lock(&i_info->data_lock);
+	memcpy(data, i_info->i_data, PNLFS_INODE_DATA_SIZE);
+	memset(i_info->i_data, 0, PNLFS_INODE_DATA_SIZE);
+	i_info->flags = 0;
+	spin_unlock(&i_info->data_lock);
+	i_info->index_block = bno;
+	dir->i_size = PNLFS_BLOCK_SIZE;
+	bh = pnl_dir_bread_new(dir, 0);
+	if (IS_ERR(bh)) {
+		pnl_free_index(dir);
+		spin_lock(&i_info->data_lock);
+		i_info->flags = PNLFS_INODE_INLINE;
+		memcpy(i_info->i_data, data, PNLFS_INODE_DATA_SIZE);
+		spin_unlock(&i_info->data_lock);
+		dir->i_size = PNLFS_INODE_DATA_SIZE;
+		return PTR_ERR(bh);
+	}
+	memcpy(bh->b_data, data, PNLFS_INODE_DATA_SIZE);
+	mark_buffer_dirty_inode(bh, dir);
+	brelse(bh);
+	mark_inode_dirty(dir);
+	return 0;
+}
+
+/*
+ * Adds the entry name to dir, the caller checks that it doesn't exist yet.
+ * A full inline directory moves to a block, a full block of a hashed
+ * directory is split until the entry fits.
+ */
+int pnl_dir_add(struct inode *dir, const struct qstr *name,
+		struct inode *inode)
+{
+	struct pnlfs_inode_info *i_info;
+	struct pnl_dir_view view;
+	struct pnl_dir_pos pos;
+	uint32_t hash;
+	int ret = 0;
+
+	i_info = container_of(dir, struct pnlfs_inode_info, vfs_inode);
+	hash = pnl_dir_hash(name->name, name->len);
+	down_write(&i_info->dir_sem);
+	for (;;) {
+		pos.block = pnl_dir_bucket(hash, pnl_dir_nr_blocks(dir));
+		ret = pnl_dir_get(dir, pos.block, 1, &view);
+		if (ret)
+			goto add_out;
+		for (pos.slot = 0; pos.slot < view.nr_files; pos.slot++) {
+			if (!view.files[pos.slot].inode)
+				break;
+		}
+		if (pos.slot < view.nr_files)
+			break;
+		pnl_dir_put(dir, &view, 0);
+		if (pnl_dir_inline(dir))
+			ret = pnl_dir_spill(dir);
+		else if (pnl_dir_indexed(dir))
+			ret = pnl_dir_split(dir);
+		else
+			ret = -ENOSPC;
+		if (ret)
+			goto add_out;
+	}
+
+	/* the entries of an inline directory are copied by write_inode */
+	spin_lock(&i_info->data_lock);
+	pnl_dir_fill(dir->i_sb, &view.files[pos.slot], name, inode);
+	spin_unlock(&i_info->data_lock);
+	pnl_dir_put(dir, &view, 1);
+	i_info->nr_entries++;
+	mark_inode_dirty(dir);
+	if (i_info->dir_cache && pnl_dir_cache_add(i_info, name->name,
+				name->len, hash, inode->i_ino, &pos))
+		pnl_dir_drop_cache(i_info);
+add_out:
+	up_write(&i_info->dir_sem);
+	return ret;
+}
+
+/* Frees the entry at pos, as returned by pnl_dir_find() */
+int pnl_dir_remove(struct inode *dir, const struct pnl_dir_pos *pos)
+{
+	struct pnlfs_inode_info *i_info;
+	struct pnl_dir_view view;
+	struct pnlfs_file *file;
+	struct pnl_dir_entry *de;
+	int len, ret;
+
+	i_info = container_of(dir, struct pnlfs_inode_info, vfs_inode);
+	down_write(&i_info->dir_sem);
+	ret = pnl_dir_get(dir, pos->block, 0, &view);
+	if (!ret && pos->slot >= view.nr_files) {
+		pnl_dir_put(dir, &view, 0);
+		ret = -ENOENT;
+	}
+	if (ret)
+		goto remove_out;
+	file = &view.files[pos->slot];
+	if (i_info->dir_cache) {
+		len = pnl_dir_entry_len(dir->i_sb, file);
+		de = pnl_dir_cache_find(i_info->dir_cache, file->filename, len,
+				pnl_dir_hash(file->filename, len), NULL);
+		if (de) {
+			hlist_del(&de->node);
+			kfree(de);
+			i_info->dir_cache->nr_entries--;
+		}
+	}
+	spin_lock(&i_info->data_lock);
+	memset(file, 0, sizeof(struct pnlfs_file));
+	spin_unlock(&i_info->data_lock);
+	pnl_dir_put(dir, &view, 1);
+	i_info->nr_entries--;
+	mark_inode_dirty(dir);
+remove_out:
+	up_write(&i_info->dir_sem);
+	return ret;
+}
+
+/* Points the entry at pos to another inode */
+int pnl_dir_set_inode(struct inode *dir, const struct pnl_dir_pos *pos,
+		struct inode *inode)
+{
+	struct pnlfs_inode_info *i_info;
+	struct pnl_dir_view view;
+	struct pnlfs_file *file;
+	struct pnl_dir_entry *de;
+	int len, ret;
+
+	i_info = container_of(dir, struct pnlfs_inode_info, vfs_inode);
+	down_write(&i_info->dir_sem);
+	ret = pnl_dir_get(dir, pos->block, 0, &view);
+	if (!ret && pos->slot >= view.nr_files) {
+		pnl_dir_put(dir, &view, 0);
+		ret = -ENOENT;
+	}
+	if (ret)
+		goto set_inode_out;
+	file = &view.files[pos->slot];
+	if (i_info->dir_cache) {
+		len = pnl_dir_entry_len(dir->i_sb, file);
+		de = pnl_dir_cache_find(i_info->dir_cache, file->filename, len,
+				pnl_dir_hash(file->filename, len), NULL);
+		if (de)
+			de->ino = inode->i_ino;
+	}
+	spin_lock(&i_info->data_lock);
+	pnl_dir_set(dir->i_sb, file, inode);
+	spin_unlock(&i_info->data_lock);
+	pnl_dir_put(dir, &view, 1);
+set_inode_out:
+	up_write(&i_info->dir_sem);
+	return ret;
+}
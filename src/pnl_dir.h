@@ -0,0 +1,38 @@
+#ifndef _PNL_DIR_H
+#define _PNL_DIR_H
+
+#include "pnlfs.h"
+
+/* Location of an entry in a directory */
+struct pnl_dir_pos {
+	uint32_t block;           /* Logical block of the directory */
+	uint32_t slot;            /* Entry in the block */
+};
+
+/* Entries of a block of a directory, see pnl_dir_get() */
+struct pnl_dir_view {
+	struct buffer_head *bh;   /* NULL for an inline directory */
+	struct pnlfs_file *files;
+	uint32_t nr_files;
+};
+
+uint32_t pnl_dir_hash(const char *name, int len);
+uint32_t pnl_dir_nr_blocks(struct inode *dir);
+int pnl_dir_get(struct inode *dir, uint32_t block, int create,
+		struct pnl_dir_view *view);
+void pnl_dir_put(struct inode *dir, struct pnl_dir_view *view, int dirty);
+void pnl_dir_readahead(struct inode *dir, uint32_t block);
+int pnl_dir_find(struct inode *dir, const struct qstr *name, ino_t *ino,
+		struct pnl_dir_pos *pos);
+uint32_t pnl_dir_name_len(struct super_block *sb);
+int pnl_dir_entry_len(struct super_block *sb, struct pnlfs_file *file);
+unsigned char pnl_dir_entry_type(struct super_block *sb,
+		struct pnlfs_file *file);
+int pnl_dir_add(struct inode *dir, const struct qstr *name,
+		struct inode *inode);
+int pnl_dir_remove(struct inode *dir, const struct pnl_dir_pos *pos);
+int pnl_dir_set_inode(struct inode *dir, const struct pnl_dir_pos *pos,
+		struct inode *inode);
+void pnl_dir_drop_cache(struct pnlfs_inode_info *i_info);
+
+#endif
@@ -0,0 +1,802 @@
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <uapi/asm-generic/errno-base.h>
+#include <uapi/asm-generic/errno.h>
+#include "pnlfs.h"
+#include "pnl_stats.h"
+#include "pnl_iops.h"
+#include "pnl_extents.h"
+#include "pnl_alloc.h"
+
+/*
+ * The extents of a file are decoded one leaf at a time : the inline root, or
+ * the leaf of the tree covering the last block looked up, kept sorted by
+ * logical block in i_info->extents. Every change is written back to the
+ * inline root of the inode or to the leaf it came from. A full leaf is split
+ * in two halves, adding an entry to the index block above it, which is split
+ * the same way when full, up to a new top of the tree. The caller must hold
+ * index_lock.
+ */
+
+/* Entry of the path from the top of the tree down to a leaf */
+struct pnl_ext_path {
+	uint32_t bno;             /* Index block */
+	uint32_t slot;            /* Entry followed in it */
+};
+
+/*
+ * Reads the extent block bno, depth levels above the leaves, or at any depth
+ * if depth is negative.
+ */
+static struct buffer_head *pnl_ext_read(struct inode *inode, uint32_t bno,
+		int depth)
+{
+	struct pnlfs_extent_block *node;
+	struct buffer_head *bh;
+
+	bh = pnl_sb_bread(inode->i_sb, bno);
+	if (!bh) {
+		pr_warn("[pnlfs] %s : error when opening block sector %d\n",
+				__func__, bno);
+		return ERR_PTR(-EIO);
+	}
+	node = (struct pnlfs_extent_block *) bh->b_data;
+	if ((depth >= 0 && le32_to_cpu(node->header.depth) != depth) ||
+	    le32_to_cpu(node->header.depth) > PNLFS_EXTENT_MAX_DEPTH ||
+	    le32_to_cpu(node->header.nr_entries) > PNLFS_EXTENTS_PER_BLOCK ||
+	    (node->header.depth && !node->header.nr_entries)) {
+		pr_warn("[pnlfs] %s : corrupted extent block %d of inode %ld\n",
+				__func__, bno, inode->i_ino);
+		brelse(bh);
+		return ERR_PTR(-EIO);
+	}
+	return bh;
+}
+
+/* Gets the new extent block bno ready, depth levels above the leaves */
+static struct buffer_head *pnl_ext_init(struct inode *inode, uint32_t bno,
+		uint32_t depth)
+{
+	struct pnlfs_extent_block *node;
+	struct buffer_head *bh;
+
+	bh = sb_getblk(inode->i_sb, bno);
+	lock_buffer(bh);
+	memset(bh->b_data, 0, PNLFS_BLOCK_SIZE);
+	node = (struct pnlfs_extent_block *) bh->b_data;
+	node->header.depth = cpu_to_le32(depth);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	return bh;
+}
+
+static void pnl_ext_encode(struct pnlfs_extent *raw,
+		struct pnl_extent *extents, uint32_t nr)
+{
+	uint32_t i;
+
+	for (i = 0; i < nr; i++) {
+		raw[i].block = cpu_to_le32(extents[i].block);
+		raw[i].start = cpu_to_le32(extents[i].start);
+		raw[i].len = cpu_to_le32(extents[i].len |
+				(extents[i].unwritten ?
+				 PNLFS_EXTENT_UNWRITTEN : 0));
+	}
+}
+
+/* Returns the entry of an index block to follow for iblock */
+static uint32_t pnl_ext_index_search(struct pnlfs_extent_index *index,
+		uint32_t nr, uint32_t iblock)
+{
+	uint32_t lo = 1, hi = nr, mid;
+
+	/* the first entry covers all the blocks before the second one */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (le32_to_cpu(index[mid].block) <= iblock)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo - 1;
+}
+
+/* Adds the entry of child at slot of an index block holding nr entries */
+static void pnl_ext_index_insert(struct pnlfs_extent_block *node,
+		uint32_t nr, uint32_t slot, uint32_t block, uint32_t child)
+{
+	memmove(&node->index[slot + 1], &node->index[slot],
+			(nr - slot) * sizeof(struct pnlfs_extent_index));
+	node->index[slot].block = cpu_to_le32(block);
+	node->index[slot].child = cpu_to_le32(child);
+	node->index[slot].reserved = 0;
+	node->header.nr_entries = cpu_to_le32(nr + 1);
+}
+
+/*
+ * Walks down the tree from its top to the leaf covering iblock, filling
+ * path[d] for the index block of depth d met on the way and path[0] for the
+ * leaf. Returns the leaf read in *bh, the depth of the top in *height and
+ * the logical blocks the leaf covers from *first to *last.
+ */
+static int pnl_ext_walk(struct inode *inode, uint32_t iblock,
+		struct pnl_ext_path *path, uint32_t *height,
+		struct buffer_head **bh, uint32_t *first, uint32_t *last)
+{
+	struct pnlfs_inode_info *i_info;
+	struct pnlfs_extent_root *root;
+	struct pnlfs_extent_block *node;
+	uint32_t bno, depth, nr, slot;
+
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	root = (struct pnlfs_extent_root *) i_info->i_data;
+	bno = le32_to_cpu(root->header.extent_block);
+	*first = 0;
+	*last = U32_MAX;
+	*bh = pnl_ext_read(inode, bno, -1);
+	if (IS_ERR(*bh))
+		return PTR_ERR(*bh);
+	node = (struct pnlfs_extent_block *) (*bh)->b_data;
+	depth = le32_to_cpu(node->header.depth);
+	*height = depth;
+	while (depth) {
+		nr = le32_to_cpu(node->header.nr_entries);
+		slot = pnl_ext_index_search(node->index, nr, iblock);
+		if (slot)
+			*first = le32_to_cpu(node->index[slot].block);
+		if (slot + 1 < nr)
+			*last = le32_to_cpu(node->index[slot + 1].block) - 1;
+		path[depth].bno = bno;
+		path[depth].slot = slot;
+		bno = le32_to_cpu(node->index[slot].child);
+		brelse(*bh);
+		*bh = pnl_ext_read(inode, bno, --depth);
+		if (IS_ERR(*bh))
+			return PTR_ERR(*bh);
+		node = (struct pnlfs_extent_block *) (*bh)->b_data;
+	}
+	path[0].bno = bno;
+	path[0].slot = 0;
+	return 0;
+}
+
+/* Decodes the leaf covering iblock, unless it is the one decoded already */
+static int pnl_ext_load(struct inode *inode, uint32_t iblock)
+{
+	struct pnlfs_inode_info *i_info;
+	struct pnlfs_extent_root *root;
+	struct pnlfs_extent_block *node;
+	struct pnl_ext_path path[PNLFS_EXTENT_MAX_DEPTH + 1];
+	struct pnlfs_extent *raw;
+	struct buffer_head *bh = NULL;
+	uint32_t nr, height, first = 0, last = U32_MAX, leaf = 0, len, i;
+	int ret;
+
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	if (i_info->extents && iblock >= i_info->ext_first &&
+	    iblock <= i_info->ext_last)
+		return 0;
+
+	if (!i_info->extents) {
+		i_info->extents = kmalloc(PNLFS_EXTENTS_PER_BLOCK *
+				sizeof(struct pnl_extent), GFP_NOFS);
+		if (!i_info->extents)
+			return -ENOMEM;
+	}
+	/* nothing is cached until the leaf is decoded */
+	i_info->nr_extents = 0;
+	i_info->ext_first = 1;
+	i_info->ext_last = 0;
+	root = (struct pnlfs_extent_root *) i_info->i_data;
+	if (root->header.extent_block) {
+		ret = pnl_ext_walk(inode, iblock, path, &height, &bh, &first,
+				&last);
+		if (ret)
+			return ret;
+		node = (struct pnlfs_extent_block *) bh->b_data;
+		nr = le32_to_cpu(node->header.nr_entries);
+		raw = node->extents;
+		leaf = path[0].bno;
+	} else {
+		nr = le32_to_cpu(root->header.nr_extents);
+		raw = root->extents;
+		if (nr > PNLFS_INLINE_EXTENTS) {
+			pr_warn("[pnlfs] %s : inode %ld has %d extents\n",
+					__func__, inode->i_ino, nr);
+			return -EIO;
+		}
+	}
+	for (i = 0; i < nr; i++) {
+		i_info->extents[i].block = le32_to_cpu(raw[i].block);
+		i_info->extents[i].start = le32_to_cpu(raw[i].start);
+		len = le32_to_cpu(raw[i].len);
+		i_info->extents[i].len = len & ~PNLFS_EXTENT_UNWRITTEN;
+		i_info->extents[i].unwritten = !!(len & PNLFS_EXTENT_UNWRITTEN);
+	}
+	brelse(bh);
+
+	i_info->nr_extents = nr;
+	i_info->ext_leaf = leaf;
+	i_info->ext_first = first;
+	i_info->ext_last = last;
+	return 0;
+}
+
+/* Writes back the decoded extents from the first one to the last one */
+static int pnl_ext_store(struct inode *inode, uint32_t first)
+{
+	struct pnlfs_inode_info *i_info;
+	struct pnlfs_extent_root *root;
+	struct pnlfs_extent_block *node;
+	struct buffer_head *bh;
+	uint32_t nr;
+
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	nr = i_info->nr_extents;
+	if (i_info->ext_leaf) {
+		bh = pnl_sb_bread(inode->i_sb, i_info->ext_leaf);
+		if (!bh) {
+			pr_warn("[pnlfs] %s : error when opening block sector %d\n",
+					__func__, i_info->ext_leaf);
+			return -EIO;
+		}
+		node = (struct pnlfs_extent_block *) bh->b_data;
+		node->header.nr_entries = cpu_to_le32(nr);
+		if (first < nr)
+			pnl_ext_encode(node->extents + first,
+					i_info->extents + first, nr - first);
+		mark_buffer_dirty_inode(bh, inode);
+		brelse(bh);
+		return 0;
+	}
+
+	root = (struct pnlfs_extent_root *) i_info->i_data;
+	/* the root is copied by pnl_write_inode() without index_lock */
+	spin_lock(&i_info->data_lock);
+	if (first < nr)
+		pnl_ext_encode(root->extents + first, i_info->extents + first,
+				nr - first);
+	root->header.nr_extents = cpu_to_le32(nr);
+	spin_unlock(&i_info->data_lock);
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+/* Moves the inline extents to a new leaf, the first top of the tree */
+static int pnl_ext_grow(struct inode *inode)
+{
+	struct pnlfs_inode_info *i_info;
+	struct pnlfs_extent_root *root;
+	struct pnlfs_extent_block *node;
+	struct buffer_head *bh;
+	uint32_t goal;
+	int bno;
+
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	/* the extent block goes next to the data of the file */
+	if (i_info->nr_extents)
+		goal = i_info->extents[0].start;
+	else
+		goal = pnl_ino_goal(inode->i_sb, inode->i_ino);
+	bno = pnl_alloc_block(inode->i_sb, goal);
+	if (bno < 0)
+		return bno;
+	bh = pnl_ext_init(inode, bno, 0);
+	node = (struct pnlfs_extent_block *) bh->b_data;
+	node->header.nr_entries = cpu_to_le32(i_info->nr_extents);
+	pnl_ext_encode(node->extents, i_info->extents, i_info->nr_extents);
+	mark_buffer_dirty_inode(bh, inode);
+	brelse(bh);
+
+	root = (struct pnlfs_extent_root *) i_info->i_data;
+	spin_lock(&i_info->data_lock);
+	memset(root, 0, sizeof(struct pnlfs_extent_root));
+	root->header.extent_block = cpu_to_le32(bno);
+	spin_unlock(&i_info->data_lock);
+	mark_inode_dirty(inode);
+	i_info->ext_leaf = bno;
+	return 0;
+}
+
+/*
+ * Splits the decoded leaf, full, in two halves : the upper one moves to a
+ * new leaf, whose entry goes to the index block above, split the same way
+ * when full. When the top of the tree splits, a new top is added above it.
+ * The blocks are all allocated first, so that the tree is left as it was
+ * when the disk is full. The decoded leaf is then the half covering iblock.
+ */
+static int pnl_ext_split(struct inode *inode, uint32_t iblock)
+{
+	struct super_block *sb = inode->i_sb;
+	struct pnlfs_inode_info *i_info;
+	struct pnlfs_extent_root *root;
+	struct pnlfs_extent_block *node, *new_node;
+	struct pnl_ext_path path[PNLFS_EXTENT_MAX_DEPTH + 1];
+	uint32_t blocks[PNLFS_EXTENT_MAX_DEPTH + 2];
+	struct buffer_head *bh, *new_bh;
+	uint32_t height, first, last, nr, mid, slot, key, child, d, i;
+	uint32_t leaf_nr, leaf_mid, leaf_key, nr_new = 1;
+	int bno, ret;
+
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	ret = pnl_ext_walk(inode, iblock, path, &height, &bh, &first, &last);
+	if (ret)
+		return ret;
+	brelse(bh);
+	/* a new block for each full level, and a new top when all are */
+	for (d = 1; d <= height; d++) {
+		bh = pnl_ext_read(inode, path[d].bno, d);
+		if (IS_ERR(bh))
+			return PTR_ERR(bh);
+		node = (struct pnlfs_extent_block *) bh->b_data;
+		nr = le32_to_cpu(node->header.nr_entries);
+		brelse(bh);
+		if (nr < PNLFS_EXTENTS_PER_BLOCK)
+			break;
+		nr_new++;
+	}
+	if (d > height) {
+		if (height == PNLFS_EXTENT_MAX_DEPTH) {
+			pr_warn_ratelimited("[pnlfs] %s : extent tree of inode %ld is full\n",
+					__func__, inode->i_ino);
+			return -ENOSPC;
+		}
+		nr_new++;
+	}
+	bno = i_info->ext_leaf;
+	for (i = 0; i < nr_new; i++) {
+		bno = pnl_alloc_block(sb, bno);
+		if (bno < 0) {
+			while (i--)
+				pnl_free_block(sb, blocks[i]);
+			return bno;
+		}
+		blocks[i] = bno;
+	}
+
+	leaf_nr = i_info->nr_extents;
+	leaf_mid = leaf_nr / 2;
+	leaf_key = i_info->extents[leaf_mid].block;
+	new_bh = pnl_ext_init(inode, blocks[0], 0);
+	new_node = (struct pnlfs_extent_block *) new_bh->b_data;
+	new_node->header.nr_entries = cpu_to_le32(leaf_nr - leaf_mid);
+	pnl_ext_encode(new_node->extents, i_info->extents + leaf_mid,
+			leaf_nr - leaf_mid);
+	mark_buffer_dirty_inode(new_bh, inode);
+	brelse(new_bh);
+	i_info->nr_extents = leaf_mid;
+	ret = pnl_ext_store(inode, leaf_mid);
+	if (ret)
+		return ret;
+
+	key = leaf_key;
+	child = blocks[0];
+	for (d = 1; d <= height; d++) {
+		bh = pnl_ext_read(inode, path[d].bno, d);
+		if (IS_ERR(bh))
+			return PTR_ERR(bh);
+		node = (struct pnlfs_extent_block *) bh->b_data;
+		nr = le32_to_cpu(node->header.nr_entries);
+		slot = path[d].slot + 1;
+		if (nr < PNLFS_EXTENTS_PER_BLOCK) {
+			pnl_ext_index_insert(node, nr, slot, key, child);
+			mark_buffer_dirty_inode(bh, inode);
+			brelse(bh);
+			goto split_done;
+		}
+		/* the upper half of the entries moves to a new index block */
+		mid = nr / 2;
+		new_bh = pnl_ext_init(inode, blocks[d], d);
+		new_node = (struct pnlfs_extent_block *) new_bh->b_data;
+		memcpy(new_node->index, &node->index[mid],
+				(nr - mid) * sizeof(struct pnlfs_extent_index));
+		new_node->header.nr_entries = cpu_to_le32(nr - mid);
+		node->header.nr_entries = cpu_to_le32(mid);
+		if (slot <= mid)
+			pnl_ext_index_insert(node, mid, slot, key, child);
+		else
+			pnl_ext_index_insert(new_node, nr - mid, slot - mid,
+					key, child);
+		key = le32_to_cpu(new_node->index[0].block);
+		child = blocks[d];
+		mark_buffer_dirty_inode(new_bh, inode);
+		brelse(new_bh);
+		mark_buffer_dirty_inode(bh, inode);
+		brelse(bh);
+	}
+
+	/* the top split, the tree grows a level */
+	root = (struct pnlfs_extent_root *) i_info->i_data;
+	new_bh = pnl_ext_init(inode, blocks[height + 1], height + 1);
+	new_node = (struct pnlfs_extent_block *) new_bh->b_data;
+	new_node->index[0].child = root->header.extent_block;
+	new_node->index[1].block = cpu_to_le32(key);
+	new_node->index[1].child = cpu_to_le32(child);
+	new_node->header.nr_entries = cpu_to_le32(2);
+	mark_buffer_dirty_inode(new_bh, inode);
+	brelse(new_bh);
+	spin_lock(&i_info->data_lock);
+	root->header.extent_block = cpu_to_le32(blocks[height + 1]);
+	spin_unlock(&i_info->data_lock);
+	mark_inode_dirty(inode);
+
+split_done:
+	if (iblock >= leaf_key) {
+		memmove(i_info->extents, i_info->extents + leaf_mid,
+				(leaf_nr - leaf_mid) *
+				sizeof(struct pnl_extent));
+		i_info->nr_extents = leaf_nr - leaf_mid;
+		i_info->ext_leaf = blocks[0];
+		i_info->ext_first = leaf_key;
+	} else {
+		i_info->ext_last = leaf_key - 1;
+	}
+	return 0;
+}
+
+/* Returns the last extent starting at or before iblock, -1 if none */
+static int pnl_ext_search(struct pnlfs_inode_info *i_info, uint32_t iblock)
+{
+	int lo = 0, hi = i_info->nr_extents - 1, mid, ret = -1;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (i_info->extents[mid].block <= iblock) {
+			ret = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return ret;
+}
+
+/*
+ * Makes room for one more decoded extent before an entry is added for
+ * iblock : the inline root moves to a leaf when full, and a full leaf is
+ * split, the decoded one being then the half covering iblock.
+ */
+static int pnl_ext_room(struct inode *inode, uint32_t iblock)
+{
+	struct pnlfs_inode_info *i_info;
+
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	if (!i_info->ext_leaf && i_info->nr_extents == PNLFS_INLINE_EXTENTS)
+		return pnl_ext_grow(inode);
+	if (i_info->nr_extents == PNLFS_EXTENTS_PER_BLOCK)
+		return pnl_ext_split(inode, iblock);
+	return 0;
+}
+
+/*
+ * Records that iblock is mapped on bno, idx being the extent returned by
+ * pnl_ext_search() for iblock. The block is merged into the surrounding
+ * extents whenever it is contiguous with them on disk and in the same state,
+ * written or unwritten.
+ */
+static int pnl_ext_insert(struct inode *inode, int idx, uint32_t iblock,
+		uint32_t bno, bool unwritten)
+{
+	struct pnlfs_inode_info *i_info;
+	struct pnl_extent *prev = NULL, *next = NULL;
+	uint32_t first;
+	int ret;
+
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	if (idx >= 0)
+		prev = &i_info->extents[idx];
+	if (idx + 1 < i_info->nr_extents)
+		next = &i_info->extents[idx + 1];
+	if (prev && (prev->block + prev->len != iblock ||
+		     prev->start + prev->len != bno ||
+		     prev->unwritten != unwritten ||
+		     prev->len == PNLFS_EXTENT_MAX_LEN))
+		prev = NULL;
+	if (next && (next->block != iblock + 1 || next->start != bno + 1 ||
+		     next->unwritten != unwritten ||
+		     next->len == PNLFS_EXTENT_MAX_LEN))
+		next = NULL;
+
+	if (prev) {
+		prev->len++;
+		first = idx;
+		if (next && prev->len + next->len <= PNLFS_EXTENT_MAX_LEN) {
+			prev->len += next->len;
+			memmove(next, next + 1, (i_info->nr_extents - idx - 2) *
+					sizeof(struct pnl_extent));
+			i_info->nr_extents--;
+		}
+	} else if (next) {
+		next->block--;
+		next->start--;
+		next->len++;
+		first = idx + 1;
+	} else {
+		ret = pnl_ext_room(inode, iblock);
+		if (ret)
+			return ret;
+		idx = pnl_ext_search(i_info, iblock);
+		first = idx + 1;
+		memmove(&i_info->extents[first + 1], &i_info->extents[first],
+				(i_info->nr_extents - first) *
+				sizeof(struct pnl_extent));
+		i_info->extents[first].block = iblock;
+		i_info->extents[first].start = bno;
+		i_info->extents[first].len = 1;
+		i_info->extents[first].unwritten = unwritten;
+		i_info->nr_extents++;
+	}
+	return pnl_ext_store(inode, first);
+}
+
+/*
+ * Takes iblock out of the extent idx covering it, which is split in two when
+ * iblock lies in its middle. Returns the block iblock was mapped on.
+ */
+static int pnl_ext_remove(struct inode *inode, int idx, uint32_t iblock)
+{
+	struct pnlfs_inode_info *i_info;
+	struct pnl_extent *extent;
+	uint32_t offset, bno;
+	int ret;
+
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	extent = &i_info->extents[idx];
+	offset = iblock - extent->block;
+	bno = extent->start + offset;
+	if (extent->len == 1) {
+		memmove(extent, extent + 1, (i_info->nr_extents - idx - 1) *
+				sizeof(struct pnl_extent));
+		i_info->nr_extents--;
+	} else if (!offset) {
+		extent->block++;
+		extent->start++;
+		extent->len--;
+	} else if (offset == extent->len - 1) {
+		extent->len--;
+	} else {
+		ret = pnl_ext_room(inode, iblock);
+		if (ret)
+			return ret;
+		/* the extent is whole in the leaf decoded after a split */
+		idx = pnl_ext_search(i_info, iblock);
+		extent = &i_info->extents[idx];
+		memmove(extent + 2, extent + 1, (i_info->nr_extents - idx - 1) *
+				sizeof(struct pnl_extent));
+		extent[1].block = iblock + 1;
+		extent[1].start = bno + 1;
+		extent[1].len = extent->len - offset - 1;
+		extent[1].unwritten = extent->unwritten;
+		extent->len = offset;
+		i_info->nr_extents++;
+	}
+	ret = pnl_ext_store(inode, idx);
+	return ret ? ret : bno;
+}
+
+/* Counts a data block added to or removed from a file */
+static void pnl_ext_count(struct inode *inode, int n)
+{
+	struct pnlfs_inode_info *i_info;
+
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	i_info->nr_entries += n;
+	inode->i_blocks = i_info->nr_entries;
+	mark_inode_dirty(inode);
+}
+
+/*
+ * Maps iblock as pnl_map_block() does for the index. An unwritten block reads
+ * as a hole, and is taken out of its extent into a written one when it is
+ * first written to.
+ */
+int pnl_ext_get_block(struct inode *inode, sector_t iblock,
+		struct buffer_head *bh_result, int create)
+{
+	struct super_block *sb = inode->i_sb;
+	struct pnlfs_inode_info *i_info;
+	struct pnl_extent *extent = NULL;
+	uint32_t goal;
+	size_t len;
+	int idx, bno, ret;
+
+	if (iblock > U32_MAX)
+		return create ? -EFBIG : 0;
+
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	mutex_lock(&i_info->index_lock);
+	ret = pnl_ext_load(inode, iblock);
+	if (ret)
+		goto ext_get_block_out;
+	idx = pnl_ext_search(i_info, iblock);
+	if (idx >= 0) {
+		extent = &i_info->extents[idx];
+		if (iblock < extent->block + extent->len &&
+		    !extent->unwritten) {
+			/* the rest of the extent is mapped with it */
+			len = min_t(sector_t, extent->block + extent->len -
+					iblock,
+				    bh_result->b_size >> inode->i_blkbits);
+			if (!len)
+				len = 1;
+			map_bh(bh_result, sb,
+			       extent->start + (iblock - extent->block));
+			bh_result->b_size = len << inode->i_blkbits;
+			goto ext_get_block_out;
+		}
+	}
+	if (!create)
+		goto ext_get_block_out;
+
+	if (extent && iblock < extent->block + extent->len) {
+		/* written to for the first time, already counted */
+		bno = pnl_ext_remove(inode, idx, iblock);
+		if (bno < 0) {
+			ret = bno;
+			goto ext_get_block_out;
+		}
+		ret = pnl_ext_insert(inode, pnl_ext_search(i_info, iblock),
+				iblock, bno, false);
+		if (ret) {
+			/* its content is lost either way */
+			pnl_free_block(sb, bno);
+			pnl_ext_count(inode, -1);
+			goto ext_get_block_out;
+		}
+	} else {
+		/* aim right after the previous extent so that it can grow */
+		goal = 0;
+		if (idx >= 0)
+			goal = extent->start + (iblock - extent->block);
+		bno = pnl_alloc_block(sb, goal);
+		if (bno < 0) {
+			ret = bno;
+			goto ext_get_block_out;
+		}
+		ret = pnl_ext_insert(inode, idx, iblock, bno, false);
+		if (ret) {
+			pnl_free_block(sb, bno);
+			goto ext_get_block_out;
+		}
+		pnl_ext_count(inode, 1);
+	}
+	map_bh(bh_result, sb, bno);
+	set_buffer_new(bh_result);
+ext_get_block_out:
+	mutex_unlock(&i_info->index_lock);
+	return ret;
+}
+
+/*
+ * Records bno, preallocated by fallocate(), as unwritten at iblock unless
+ * iblock is mapped already. Returns 1 if bno was recorded, 0 if not.
+ */
+int pnl_ext_prealloc_block(struct inode *inode, sector_t iblock, uint32_t bno)
+{
+	struct pnlfs_inode_info *i_info;
+	struct pnl_extent *extent;
+	int idx, ret;
+
+	if (iblock > U32_MAX)
+		return -EFBIG;
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	mutex_lock(&i_info->index_lock);
+	ret = pnl_ext_load(inode, iblock);
+	if (ret)
+		goto ext_prealloc_out;
+	idx = pnl_ext_search(i_info, iblock);
+	extent = idx >= 0 ? &i_info->extents[idx] : NULL;
+	if (extent && iblock < extent->block + extent->len)
+		goto ext_prealloc_out;
+	ret = pnl_ext_insert(inode, idx, iblock, bno, true);
+	if (!ret) {
+		pnl_ext_count(inode, 1);
+		ret = 1;
+	}
+ext_prealloc_out:
+	mutex_unlock(&i_info->index_lock);
+	return ret;
+}
+
+/*
+ * Returns the block mapped at iblock, written or unwritten, 0 for a hole. The
+ * block is taken out of its extent if unmap is set.
+ */
+int pnl_ext_lookup(struct inode *inode, sector_t iblock, bool unmap)
+{
+	struct pnlfs_inode_info *i_info;
+	struct pnl_extent *extent;
+	int idx, ret;
+
+	if (iblock > U32_MAX)
+		return 0;
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	mutex_lock(&i_info->index_lock);
+	ret = pnl_ext_load(inode, iblock);
+	if (ret)
+		goto ext_lookup_out;
+	idx = pnl_ext_search(i_info, iblock);
+	extent = idx >= 0 ? &i_info->extents[idx] : NULL;
+	if (!extent || iblock >= extent->block + extent->len)
+		goto ext_lookup_out;
+	if (!unmap) {
+		ret = extent->start + (iblock - extent->block);
+		goto ext_lookup_out;
+	}
+	ret = pnl_ext_remove(inode, idx, iblock);
+	if (ret > 0)
+		pnl_ext_count(inode, -1);
+ext_lookup_out:
+	mutex_unlock(&i_info->index_lock);
+	return ret;
+}
+
+/*
+ * Frees the blocks mapped below the extent block bno, of any depth if depth
+ * is negative, along with bno itself.
+ */
+static void pnl_ext_free_tree(struct inode *inode, uint32_t bno, int depth)
+{
+	struct super_block *sb = inode->i_sb;
+	struct pnlfs_extent_block *node;
+	struct buffer_head *bh;
+	uint32_t nr, len, i, j;
+
+	bh = pnl_ext_read(inode, bno, depth);
+	if (IS_ERR(bh)) {
+		pr_warn("[pnlfs] %s : blocks of inode %ld below %d are lost\n",
+				__func__, inode->i_ino, bno);
+		return;
+	}
+	node = (struct pnlfs_extent_block *) bh->b_data;
+	depth = le32_to_cpu(node->header.depth);
+	nr = le32_to_cpu(node->header.nr_entries);
+	for (i = 0; i < nr; i++) {
+		if (depth) {
+			pnl_ext_free_tree(inode,
+					le32_to_cpu(node->index[i].child),
+					depth - 1);
+			continue;
+		}
+		len = le32_to_cpu(node->extents[i].len) &
+			~PNLFS_EXTENT_UNWRITTEN;
+		for (j = 0; j < len; j++)
+			pnl_free_block(sb, le32_to_cpu(node->extents[i].start)
+					+ j);
+	}
+	bforget(bh);
+	pnl_free_block(sb, bno);
+}
+
+/* Frees the blocks of a released inode along with its extent blocks */
+void pnl_ext_free(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct pnlfs_inode_info *i_info;
+	struct pnlfs_extent_root *root;
+	uint32_t bno, nr, len, i, j;
+
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	mutex_lock(&i_info->index_lock);
+	root = (struct pnlfs_extent_root *) i_info->i_data;
+	bno = le32_to_cpu(root->header.extent_block);
+	if (bno) {
+		pnl_ext_free_tree(inode, bno, -1);
+	} else {
+		nr = min_t(uint32_t, le32_to_cpu(root->header.nr_extents),
+				PNLFS_INLINE_EXTENTS);
+		for (i = 0; i < nr; i++) {
+			len = le32_to_cpu(root->extents[i].len) &
+				~PNLFS_EXTENT_UNWRITTEN;
+			for (j = 0; j < len; j++)
+				pnl_free_block(sb,
+					le32_to_cpu(root->extents[i].start) + j);
+		}
+	}
+	/* nothing is left to look up */
+	i_info->nr_extents = 0;
+	i_info->ext_first = 1;
+	i_info->ext_last = 0;
+	mutex_unlock(&i_info->index_lock);
+}
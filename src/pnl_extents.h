@@ -0,0 +1,17 @@
+#ifndef _PNL_EXTENTS_H
+#define _PNL_EXTENTS_H
+
+/* Decoded struct pnlfs_extent */
+struct pnl_extent {
+	uint32_t block;
+	uint32_t start;
+	uint32_t len;             /* Without PNLFS_EXTENT_UNWRITTEN */
+	bool unwritten;
+};
+
+int pnl_ext_get_block(struct inode *inode, sector_t iblock,
+		struct buffer_head *bh_result, int create);
+int pnl_ext_prealloc_block(struct inode *inode, sector_t iblock, uint32_t bno);
+int pnl_ext_lookup(struct inode *inode, sector_t iblock, bool unmap);
+void pnl_ext_free(struct inode *inode);
+#endif
@@ -1,238 +1,1411 @@
 #include <linux/fs.h>
 #include <linux/dcache.h>
+#include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/mm.h>
+#include <linux/mpage.h>
+#include <linux/pagemap.h>
+#include <linux/writeback.h>
 #include <linux/slab.h>
+#include <linux/falloc.h>
 #include <uapi/asm-generic/errno-base.h>
 #include <uapi/asm-generic/errno.h>
 #include <uapi/linux/stat.h>
 #include <uapi/linux/fs.h>
 #include "pnl_iops.h"
+#include "pnl_ifops.h"
+#include "pnl_inode.h"
+#include "pnl_extents.h"
+#include "pnl_dir.h"
+#include "pnl_alloc.h"
 #include "pnlfs.h"
-// /!\ Open the index_block beforehand on a buffer head with sb_bread()
-int pnl_find_index_block(struct pnlfs_file_index_block *index_block,
-		uint32_t idx)
-{
-	int i = 0, cpt = 0;
-	while (i != PNLFS_MAX_BLOCKS_PER_FILE)
-	{
-		if (index_block->blocks[i] != 0) {
-			if (cpt == idx)
-				break;
-			else
-				cpt++;
-			i++;
-		} else {
-			i++;
+#include "pnl_stats.h"
+#include "pnl_trace.h"
+/* Starts reading the inodes of the entries of a directory block from slot */
+static void pnl_readdir_ahead(struct super_block *sb,
+		struct pnl_dir_view *view, uint32_t slot)
+{
+	struct blk_plug plug;
+	uint32_t offset;
+	int bno, last = -1;
+
+	blk_start_plug(&plug);
+	for (; slot < view->nr_files; slot++) {
+		if (!view->files[slot].inode)
 			continue;
-		}
+		bno = pnl_inode_block(sb, le32_to_cpu(view->files[slot].inode),
+				&offset);
+		/* siblings are allocated close to each other */
+		if (bno < 0 || bno == last)
+			continue;
+		sb_breadahead(sb, bno);
+		last = bno;
 	}
-	pr_warn("[pnlfs] %s : block %d found at index %d\n", __func__, i, le32_to_cpu(index_block->blocks[i]));
-	return i;
+	blk_finish_plug(&plug);
 }
 
+/* Fills the inodes of a block emitted earlier, then releases it */
+static void pnl_readdir_behind(struct inode *dir, struct pnl_dir_view *view)
+{
+	if (view->files)
+		pnl_iget_batch(dir->i_sb, view->files, view->nr_files);
+	pnl_dir_put(dir, view, 0);
+	view->bh = NULL;
+	view->files = NULL;
+}
+
+/*
+ * ctx->pos is the location of the next entry to emit, so that a listing
+ * resumes where the previous call stopped.
+ *
+ * A listing is usually followed by a stat() of each entry : the inodes of
+ * the entries of a block are read ahead before they are emitted, and brought
+ * in the inode cache by pnl_iget_batch() one block behind, or at the end of
+ * the call, once the reads had time to complete.
+ */
 int pnl_readdir(struct file *file, struct dir_context *ctx)
 {
-	uint32_t i=0, ino, index_block, nr_entries, err;
-	struct super_block *sb;
-	struct inode *inode = file->f_inode;
-	struct pnlfs_inode_info *i_info;
-	struct buffer_head *bh;
-	struct pnlfs_dir_block *dir_block;
-	struct pnlfs_file raw_child;
-	ssize_t len;
-	char *name;
-	if (ctx->pos) {
-		return 0;
-	}
-	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
-	if (!i_info)
-		return 0;
+	struct inode *inode = file_inode(file);
+	struct super_block *sb = inode->i_sb;
+	struct pnl_dir_view view, behind = { NULL };
+	struct pnlfs_file *raw_child;
+	uint32_t block, slot, nr_blocks;
+	int ret = 0;
+
 	if (!dir_emit_dots(file, ctx))
 		return 0;
-	sb = inode->i_sb;
-	index_block = i_info->index_block;
-	nr_entries = i_info->nr_entries;
-	if (!sb)
-		return 0;
-	bh = sb_bread(sb, index_block);
-	dir_block = (struct pnlfs_dir_block *) bh->b_data;
-	for(i=0; i<i_info->nr_entries; i++)
-	{
-		raw_child = dir_block->files[i];
-		ino = le32_to_cpu(raw_child.inode);
-		len = strnlen(raw_child.filename, PNLFS_FILENAME_LEN);
-		name = raw_child.filename;
-		if(ino)
-		{
-			err = dir_emit(ctx, name, len, ino, DT_UNKNOWN);
-			if(!err)
-			{
-				brelse(bh);
-				return 0;
-			}
-			ctx->pos += sizeof(struct pnlfs_file);
+	nr_blocks = pnl_dir_nr_blocks(inode);
+	block = (ctx->pos - 2) / PNLFS_MAX_DIR_ENTRIES;
+	slot = (ctx->pos - 2) % PNLFS_MAX_DIR_ENTRIES;
+	for (; block < nr_blocks; block++, slot = 0) {
+		/* the blocks of a directory mostly follow each other */
+		pnl_dir_readahead(inode, block + 1);
+		ret = pnl_dir_get(inode, block, 0, &view);
+		if (ret)
+			break;
+		pnl_readdir_ahead(sb, &view, slot);
+		pnl_readdir_behind(inode, &behind);
+		behind = view;
+		for (; slot < view.nr_files; slot++, ctx->pos++) {
+			raw_child = &view.files[slot];
+			if (!raw_child->inode)
+				continue;
+			if (!dir_emit(ctx, raw_child->filename,
+				      pnl_dir_entry_len(sb, raw_child),
+				      le32_to_cpu(raw_child->inode),
+				      pnl_dir_entry_type(sb, raw_child)))
+				break;
 		}
+		if (slot < view.nr_files)
+			break;
+		/* past a hole, or the entries of an inline directory */
+		if (slot < PNLFS_MAX_DIR_ENTRIES)
+			ctx->pos += PNLFS_MAX_DIR_ENTRIES - slot;
 	}
-	brelse(bh);
-	return 0;
+	pnl_readdir_behind(inode, &behind);
+	return ret;
 }
 
-ssize_t pnl_read(struct file *filp, char __user *buf, size_t size,
-		loff_t *off)
-	// Reads without pejudice about the data as long as in the boundary of
-	// the file (no \0 check!)
+void pnl_drop_index_cache(struct pnlfs_inode_info *i_info)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(i_info->index_cache); i++) {
+		kfree(i_info->index_cache[i].blocks);
+		i_info->index_cache[i].blocks = NULL;
+	}
+}
+
+/*
+ * Returns the decoded index block bno, reading it in the cache slot of its
+ * level on a miss. The caller must hold index_lock.
+ */
+static uint32_t *pnl_get_index(struct inode *inode, int level, uint32_t bno)
 {
-	struct inode *inode = filp->f_inode;
 	struct pnlfs_inode_info *i_info;
-	struct buffer_head *bh, *bh2;
+	struct pnl_index_cache *cache;
+	struct buffer_head *bh;
 	struct pnlfs_file_index_block *file_index_block;
-	u32 bno, r_start, s_len = 0, bidx, ret = 0, r_done = 0;
+	int i;
 
-	if (inode->i_size == PNLFS_MAX_BLOCKS_PER_FILE)
-	{
-		pr_warn("[pnlfs] %s : exceeding max file capacity\n", __func__);
-		return -ENOSPC;
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	cache = &i_info->index_cache[level];
+	if (cache->blocks && cache->bno == bno)
+		return cache->blocks;
+
+	if (!cache->blocks) {
+		cache->blocks = kmalloc(PNLFS_INDEX_ENTRIES * sizeof(uint32_t),
+				GFP_NOFS);
+		if (!cache->blocks)
+			return ERR_PTR(-ENOMEM);
 	}
-	if (S_ISDIR(filp->f_mode))
-	{
-		pr_warn("[pnlfs] %s : not a directory\n", __func__);
-		return -EISDIR;
+	bh = pnl_sb_bread(inode->i_sb, bno);
+	if (!bh) {
+		pr_warn("[pnlfs] %s : error when opening block sector %d\n",
+				__func__, bno);
+		kfree(cache->blocks);
+		cache->blocks = NULL;
+		return ERR_PTR(-EIO);
 	}
+	file_index_block = (struct pnlfs_file_index_block *) bh->b_data;
+	for (i = 0; i < PNLFS_INDEX_ENTRIES; i++)
+		cache->blocks[i] = le32_to_cpu(file_index_block->blocks[i]);
+	brelse(bh);
+	cache->bno = bno;
+	return cache->blocks;
+}
 
-	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
-	if (i_info->nr_entries == 0)
-		return 0;
-	bh = sb_bread(inode->i_sb, i_info->index_block);
-	if (!bh)
-	{
+/*
+ * Fills offsets with the entry to follow in each index block on the way to
+ * iblock, and levels with the cache slot of each of these index blocks.
+ * Returns the number of index blocks on the way, 0 if iblock is too far.
+ */
+static int pnl_index_path(struct super_block *sb, sector_t iblock,
+		uint32_t offsets[3], int levels[3])
+{
+	struct pnlfs_sb_info *sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+
+	levels[0] = 0;
+	if (!(sb_info->features & PNLFS_FEATURE_INDIRECT)) {
+		if (iblock >= PNLFS_MAX_BLOCKS_PER_FILE)
+			return 0;
+		offsets[0] = iblock;
+		return 1;
+	}
+	if (iblock < PNLFS_DIRECT_BLOCKS) {
+		offsets[0] = iblock;
+		return 1;
+	}
+	iblock -= PNLFS_DIRECT_BLOCKS;
+	if (iblock < PNLFS_INDEX_ENTRIES) {
+		offsets[0] = PNLFS_IND_BLOCK;
+		offsets[1] = iblock;
+		levels[1] = 1;
+		return 2;
+	}
+	iblock -= PNLFS_INDEX_ENTRIES;
+	if (iblock < PNLFS_INDEX_ENTRIES * PNLFS_INDEX_ENTRIES) {
+		offsets[0] = PNLFS_DIND_BLOCK;
+		offsets[1] = iblock / PNLFS_INDEX_ENTRIES;
+		offsets[2] = iblock % PNLFS_INDEX_ENTRIES;
+		levels[1] = 2;
+		levels[2] = 3;
+		return 3;
+	}
+	return 0;
+}
+
+/* Allocates a zeroed index block */
+int pnl_new_index(struct super_block *sb, struct inode *inode,
+		uint32_t goal)
+{
+	struct buffer_head *bh;
+	int bno;
+
+	bno = pnl_alloc_block(sb, goal);
+	if (bno < 0)
+		return bno;
+	bh = sb_getblk(sb, bno);
+	lock_buffer(bh);
+	memset(bh->b_data, 0, PNLFS_BLOCK_SIZE);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty_inode(bh, inode);
+	brelse(bh);
+	return bno;
+}
+
+/* Sets the entry slot of the index block bno, decoded in index */
+static int pnl_set_index(struct inode *inode, uint32_t bno, uint32_t *index,
+		uint32_t slot, uint32_t value)
+{
+	struct buffer_head *bh;
+	struct pnlfs_file_index_block *file_index_block;
+
+	bh = pnl_sb_bread(inode->i_sb, bno);
+	if (!bh) {
 		pr_warn("[pnlfs] %s : error when opening block sector %d\n",
-				__func__, i_info->index_block);
+				__func__, bno);
 		return -EIO;
 	}
 	file_index_block = (struct pnlfs_file_index_block *) bh->b_data;
+	file_index_block->blocks[slot] = cpu_to_le32(value);
+	mark_buffer_dirty_inode(bh, inode);
+	brelse(bh);
+	index[slot] = value;
+	return 0;
+}
+
+/*
+ * Walks the index of inode down to the index block holding the entry of
+ * iblock, allocating the missing indirect blocks on the way if create is set.
+ * Sets *leaf to that index block and *slot to the entry, and returns the
+ * decoded index block, NULL if iblock lies under a missing indirect block.
+ * The caller must hold index_lock.
+ */
+static uint32_t *pnl_index_leaf(struct inode *inode, sector_t iblock,
+		int create, uint32_t *leaf, uint32_t *slot)
+{
+	struct super_block *sb = inode->i_sb;
+	struct pnlfs_inode_info *i_info;
+	uint32_t *index, offsets[3], bno, next, goal;
+	int levels[3], depth, level, new_bno, ret;
 
-	bidx = (*off) / PNLFS_BLOCK_SIZE;
-	r_start = (*off) % PNLFS_BLOCK_SIZE;
-	while (!r_done) {
-		bno = pnl_find_index_block(file_index_block, bidx);
-		bno = le32_to_cpu(file_index_block->blocks[bno]);
-		bh2 = sb_bread(inode->i_sb, bno);
-		s_len = strnlen(bh2->b_data + (*off),
-				PNLFS_BLOCK_SIZE - r_start);
-		if (s_len == PNLFS_BLOCK_SIZE - r_start) // fin du bloc
-		{
-			r_start = 0;
-			if (!((char)bh2->b_data[PNLFS_BLOCK_SIZE])) // \0
-				r_done = 1;
-			bidx++;
-		} else {
-			r_done = 1;
-		}
-		memcpy(buf + ret, bh2->b_data, s_len);
-		ret += s_len;
-		brelse(bh2);
+	depth = pnl_index_path(sb, iblock, offsets, levels);
+	if (!depth)
+		return create ? ERR_PTR(-EFBIG) : NULL;
+
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	bno = i_info->index_block;
+	for (level = 0; level < depth - 1; level++) {
+		index = pnl_get_index(inode, levels[level], bno);
+		if (IS_ERR(index))
+			return index;
+		next = index[offsets[level]];
+		if (!next) {
+			if (!create)
+				return NULL;
+			/* right after the previous block of the file */
+			goal = bno + 1;
+			if (offsets[level] && index[offsets[level] - 1])
+				goal = (index[offsets[level] - 1] &
+					~PNLFS_INDEX_UNWRITTEN) + 1;
+			new_bno = pnl_new_index(sb, inode, goal);
+			if (new_bno < 0)
+				return ERR_PTR(new_bno);
+			ret = pnl_set_index(inode, bno, index, offsets[level],
+					new_bno);
+			if (ret) {
+				pnl_free_block(sb, new_bno);
+				return ERR_PTR(ret);
+			}
+			next = new_bno;
+		}
+		bno = next;
+	}
+	index = pnl_get_index(inode, levels[depth - 1], bno);
+	if (!IS_ERR(index)) {
+		*leaf = bno;
+		*slot = offsets[depth - 1];
+	}
+	return index;
+}
+
+/* Counts a data block added to or removed from a regular file */
+static void pnl_index_count(struct inode *inode, int n)
+{
+	struct pnlfs_inode_info *i_info;
+
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	/* nr_entries counts entries of directories */
+	if (S_ISREG(inode->i_mode)) {
+		i_info->nr_entries += n;
+		inode->i_blocks = i_info->nr_entries;
 	}
-	brelse(bh);
-	(*off) += ret;
 	mark_inode_dirty(inode);
+}
+
+/*
+ * Returns the block mapped at iblock by the index of inode, 0 for a hole.
+ * Index blocks are directly indexed by iblock, so a missing block is a hole
+ * which is allocated, along with the missing indirect blocks on its way, if
+ * create is set. new is then set when a block was allocated, or when a block
+ * preallocated by fallocate() is written for the first time.
+ */
+int pnl_map_block(struct inode *inode, sector_t iblock, int create, int *new)
+{
+	struct super_block *sb = inode->i_sb;
+	struct pnlfs_inode_info *i_info;
+	uint32_t *index, leaf, slot, entry, goal;
+	int bno, ret;
+
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	mutex_lock(&i_info->index_lock);
+	index = pnl_index_leaf(inode, iblock, create, &leaf, &slot);
+	ret = 0;
+	if (IS_ERR(index))
+		ret = PTR_ERR(index);
+	if (IS_ERR_OR_NULL(index))
+		goto map_block_out;
+	entry = index[slot];
+	if (entry && !(entry & PNLFS_INDEX_UNWRITTEN)) {
+		ret = entry;
+		goto map_block_out;
+	}
+	/* an unwritten block reads as a hole */
+	if (!create)
+		goto map_block_out;
+
+	if (entry) {
+		bno = entry & ~PNLFS_INDEX_UNWRITTEN;
+		ret = pnl_set_index(inode, leaf, index, slot, bno);
+		if (ret)
+			goto map_block_out;
+	} else {
+		/* blocks are allocated after the previous one of the file */
+		goal = leaf + 1;
+		if (slot && index[slot - 1])
+			goal = (index[slot - 1] & ~PNLFS_INDEX_UNWRITTEN) + 1;
+		bno = pnl_alloc_block(sb, goal);
+		if (bno < 0) {
+			ret = bno;
+			goto map_block_out;
+		}
+		ret = pnl_set_index(inode, leaf, index, slot, bno);
+		if (ret) {
+			pnl_free_block(sb, bno);
+			goto map_block_out;
+		}
+		pnl_index_count(inode, 1);
+	}
+	*new = 1;
+	ret = bno;
+map_block_out:
+	mutex_unlock(&i_info->index_lock);
+	return ret;
+}
+
+/*
+ * Records the preallocated block bno at iblock, unless iblock is mapped
+ * already. Returns 1 if bno was recorded, 0 if not.
+ */
+static int pnl_prealloc_block(struct inode *inode, sector_t iblock,
+		uint32_t bno)
+{
+	struct pnlfs_inode_info *i_info;
+	uint32_t *index, leaf, slot;
+	int ret;
+
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	if (i_info->flags & PNLFS_INODE_EXTENTS)
+		return pnl_ext_prealloc_block(inode, iblock, bno);
+	mutex_lock(&i_info->index_lock);
+	index = pnl_index_leaf(inode, iblock, 1, &leaf, &slot);
+	if (IS_ERR(index)) {
+		ret = PTR_ERR(index);
+	} else if (index[slot]) {
+		ret = 0;
+	} else {
+		ret = pnl_set_index(inode, leaf, index, slot,
+				bno | PNLFS_INDEX_UNWRITTEN);
+		if (!ret) {
+			pnl_index_count(inode, 1);
+			ret = 1;
+		}
+	}
+	mutex_unlock(&i_info->index_lock);
 	return ret;
 }
 
+/*
+ * Returns the block reserved at iblock, written or unwritten, 0 for a hole.
+ */
+static int pnl_block_reserved(struct inode *inode, sector_t iblock)
+{
+	struct pnlfs_inode_info *i_info;
+	uint32_t *index, leaf, slot;
+	int ret;
 
-ssize_t pnl_write(struct file *filp, const char __user *buf, size_t size,
-		loff_t *off)
-	// Reads without pejudice about the data as long as in the boundary of
-	// the file (no \0 check!)
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	if (i_info->flags & PNLFS_INODE_EXTENTS)
+		return pnl_ext_lookup(inode, iblock, false);
+	mutex_lock(&i_info->index_lock);
+	index = pnl_index_leaf(inode, iblock, 0, &leaf, &slot);
+	if (IS_ERR(index))
+		ret = PTR_ERR(index);
+	else if (index)
+		ret = index[slot] & ~PNLFS_INDEX_UNWRITTEN;
+	else
+		ret = 0;
+	mutex_unlock(&i_info->index_lock);
+	return ret;
+}
+
+/* Clears the entry of iblock, and returns the block it mapped, 0 if none */
+static int pnl_unmap_block(struct inode *inode, sector_t iblock)
 {
-	struct inode *inode = filp->f_inode;
 	struct pnlfs_inode_info *i_info;
-	struct buffer_head *bh, *bh2;
-	struct pnlfs_file_index_block *file_index_block;
-	u32 bno, w_start, s_len = 0, w_end = 0, bidx, ret = 0, nr_entries = 0;
+	uint32_t *index, leaf, slot, entry;
+	int ret = 0;
 
-	if (inode->i_size == PNLFS_MAX_BLOCKS_PER_FILE)
-	{
-		pr_warn("[pnlfs] %s : exceeding max file capacity\n", __func__);
-		return -ENOSPC;
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	if (i_info->flags & PNLFS_INODE_EXTENTS)
+		return pnl_ext_lookup(inode, iblock, true);
+	mutex_lock(&i_info->index_lock);
+	index = pnl_index_leaf(inode, iblock, 0, &leaf, &slot);
+	if (IS_ERR(index)) {
+		ret = PTR_ERR(index);
+	} else if (index && index[slot]) {
+		entry = index[slot];
+		ret = pnl_set_index(inode, leaf, index, slot, 0);
+		if (!ret) {
+			pnl_index_count(inode, -1);
+			ret = entry & ~PNLFS_INDEX_UNWRITTEN;
+		}
 	}
-	if (S_ISDIR(filp->f_mode))
-	{
-		pr_warn("[pnlfs] %s : not a directory\n", __func__);
-		return -EISDIR;
+	mutex_unlock(&i_info->index_lock);
+	return ret;
+}
+
+/* Frees bno along with the blocks it maps, depth levels of index below it */
+static void pnl_free_tree(struct super_block *sb, uint32_t bno, int depth)
+{
+	struct buffer_head *bh;
+	struct pnlfs_file_index_block *index;
+	uint32_t i, next;
+
+	if (depth) {
+		bh = pnl_sb_bread(sb, bno);
+		if (!bh) {
+			pr_warn("[pnlfs] %s : error when opening block sector %d\n",
+					__func__, bno);
+			return;
+		}
+		index = (struct pnlfs_file_index_block *) bh->b_data;
+		for (i = 0; i < PNLFS_INDEX_ENTRIES; i++) {
+			next = le32_to_cpu(index->blocks[i]) &
+				~PNLFS_INDEX_UNWRITTEN;
+			if (next)
+				pnl_free_tree(sb, next, depth - 1);
+		}
+		/* its changes must not reach the disk anymore */
+		bforget(bh);
+	} else {
+		/* the blocks of directories are in the buffer cache */
+		bforget(sb_find_get_block(sb, bno));
 	}
+	pnl_free_block(sb, bno);
+}
+
+/*
+ * Frees the blocks of a released inode mapped by its index, and its index
+ * block. The single block of a directory without PNLFS_FEATURE_DIR_INDEX is
+ * its index block.
+ */
+void pnl_free_index(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct pnlfs_sb_info *sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+	struct pnlfs_inode_info *i_info;
+	struct buffer_head *bh;
+	struct pnlfs_file_index_block *index;
+	uint32_t i, next;
+	int depth;
 
 	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
-	bh = sb_bread(inode->i_sb, i_info->index_block);
-	if (!bh)
-	{
+	if (!i_info->index_block)
+		return;
+	if (S_ISDIR(inode->i_mode) &&
+			!(sb_info->features & PNLFS_FEATURE_DIR_INDEX)) {
+		bforget(sb_find_get_block(sb, i_info->index_block));
+		goto free_index_block;
+	}
+	bh = pnl_sb_bread(sb, i_info->index_block);
+	if (!bh) {
 		pr_warn("[pnlfs] %s : error when opening block sector %d\n",
 				__func__, i_info->index_block);
+		return;
+	}
+	index = (struct pnlfs_file_index_block *) bh->b_data;
+	for (i = 0; i < PNLFS_INDEX_ENTRIES; i++) {
+		next = le32_to_cpu(index->blocks[i]) & ~PNLFS_INDEX_UNWRITTEN;
+		if (!next)
+			continue;
+		depth = 0;
+		if ((sb_info->features & PNLFS_FEATURE_INDIRECT) &&
+				i >= PNLFS_DIRECT_BLOCKS)
+			depth = i - PNLFS_DIRECT_BLOCKS + 1;
+		pnl_free_tree(sb, next, depth);
+	}
+	bforget(bh);
+free_index_block:
+	pnl_free_block(sb, i_info->index_block);
+	i_info->index_block = 0;
+}
+
+/*
+ * Maps the logical block iblock of a regular file on its data block, through
+ * its index or its extents for files flagged PNLFS_INODE_EXTENTS.
+ *
+ * Up to bh_result->b_size bytes are asked for : the blocks already on disk
+ * which follow the first one are mapped along with it, so that readahead
+ * and direct I/O build a single bio for them. A new block is mapped alone.
+ */
+int pnl_get_block(struct inode *inode, sector_t iblock,
+		struct buffer_head *bh_result, int create)
+{
+	struct pnlfs_inode_info *i_info;
+	unsigned long max_blocks = bh_result->b_size >> inode->i_blkbits;
+	unsigned long n;
+	int bno, next, new = 0, ret;
+
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	/* pnl_unpack() gives blocks to packed files first */
+	if (i_info->flags & (PNLFS_INODE_INLINE | PNLFS_INODE_FRAG)) {
+		if (!create)
+			return 0;
+		pr_warn("[pnlfs] %s : inode %ld is packed\n", __func__,
+				inode->i_ino);
 		return -EIO;
 	}
-	file_index_block = (struct pnlfs_file_index_block *) bh->b_data;
-	if ((i_info->nr_entries == 0) && (inode->i_size == 0))
-	{
-		bno = pnl_new_index_block(inode->i_sb, inode);
-		file_index_block->blocks[0] = cpu_to_le32(bno);
-		i_info->nr_entries++;
+	if (i_info->flags & PNLFS_INODE_EXTENTS) {
+		ret = pnl_ext_get_block(inode, iblock, bh_result, create);
+		if (!ret && buffer_mapped(bh_result))
+			pnl_stat_add(inode->i_sb, PNL_STAT_MAPPED_BLOCKS,
+					bh_result->b_size >> inode->i_blkbits);
+		return ret;
+	}
+
+	bno = pnl_map_block(inode, iblock, create, &new);
+	if (bno <= 0)
+		return bno;
+	for (n = 1; !new && n < max_blocks; n++) {
+		next = pnl_map_block(inode, iblock + n, 0, &new);
+		if (next != bno + n)
+			break;
+	}
+	pnl_stat_add(inode->i_sb, PNL_STAT_MAPPED_BLOCKS, n);
+	map_bh(bh_result, inode->i_sb, bno);
+	bh_result->b_size = n << inode->i_blkbits;
+	if (new)
+		set_buffer_new(bh_result);
+	return 0;
+}
+
+/*
+ * Packed files hold their data in their inode or in a fragment, see struct
+ * pnlfs_inode_large. It is only changed with their first page locked, by
+ * pnl_write_end() or when it moves, so that the page and the packed data
+ * always agree. The inline area itself changes under data_lock.
+ */
+static bool pnl_is_packed(struct inode *inode)
+{
+	struct pnlfs_inode_info *i_info;
+
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	return i_info->flags & (PNLFS_INODE_INLINE | PNLFS_INODE_FRAG);
+}
+
+/* Bytes a packed file has room for, in its inode or its fragment */
+static size_t pnl_packed_room(struct pnlfs_inode_info *i_info)
+{
+	struct pnlfs_frag *frag = (struct pnlfs_frag *) i_info->i_data;
+
+	if (i_info->flags & PNLFS_INODE_INLINE)
+		return PNLFS_INODE_DATA_SIZE;
+	if (!frag->block)
+		return 0;
+	return le16_to_cpu(frag->nr_slots) * PNLFS_FRAG_SIZE;
+}
+
+/*
+ * Returns the data of a packed file with some room : its inode, or its
+ * fragment whose block is then read in *bh, to be released with brelse().
+ */
+static __u8 *pnl_packed_data(struct inode *inode, struct buffer_head **bh)
+{
+	struct pnlfs_inode_info *i_info;
+	struct pnlfs_frag *frag;
+	uint32_t bno;
+
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	*bh = NULL;
+	if (i_info->flags & PNLFS_INODE_INLINE)
+		return i_info->i_data;
+	frag = (struct pnlfs_frag *) i_info->i_data;
+	bno = le32_to_cpu(frag->block);
+	*bh = pnl_sb_bread(inode->i_sb, bno);
+	if (!*bh) {
+		pr_warn("[pnlfs] %s : error when opening block sector %d\n",
+				__func__, bno);
+		return ERR_PTR(-EIO);
 	}
+	return (*bh)->b_data + le16_to_cpu(frag->slot) * PNLFS_FRAG_SIZE;
+}
+
+/* Gives back the fragment described by frag, if any */
+static void pnl_put_frag(struct super_block *sb, struct pnlfs_frag *frag)
+{
+	if (frag->block)
+		pnl_frag_free(sb, le32_to_cpu(frag->block),
+				le16_to_cpu(frag->slot),
+				le16_to_cpu(frag->nr_slots));
+}
 
-	if (filp->f_flags & O_APPEND) {
-		bidx = i_info->nr_entries - 1;
-		w_start = inode->i_size % PNLFS_BLOCK_SIZE;
+/* Frees the fragment of a file flagged PNLFS_INODE_FRAG */
+void pnl_free_frag(struct inode *inode)
+{
+	struct pnlfs_inode_info *i_info;
+
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	if (i_info->flags & PNLFS_INODE_FRAG)
+		pnl_put_frag(inode->i_sb, (struct pnlfs_frag *) i_info->i_data);
+}
+
+/* Fills a locked page of a packed file, only the first one holds data */
+static int pnl_packed_fill(struct inode *inode, struct page *page)
+{
+	struct pnlfs_inode_info *i_info;
+	struct buffer_head *bh = NULL;
+	__u8 *data = NULL;
+	size_t size = 0;
+	void *kaddr;
+
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	if (!page->index)
+		size = min_t(loff_t, i_size_read(inode),
+				pnl_packed_room(i_info));
+	if (size) {
+		data = pnl_packed_data(inode, &bh);
+		if (IS_ERR(data))
+			return PTR_ERR(data);
+	}
+	kaddr = kmap_atomic(page);
+	memcpy(kaddr, data, size);
+	memset(kaddr + size, 0, PAGE_SIZE - size);
+	kunmap_atomic(kaddr);
+	brelse(bh);
+	flush_dcache_page(page);
+	SetPageUptodate(page);
+	return 0;
+}
+
+/*
+ * Moves the data of a packed file, held by its first page locked and
+ * uptodate, to a data block mapped by extents or by a new index block from
+ * then on. The packed data is kept if no block can be found.
+ */
+static int pnl_unpack_page(struct inode *inode, struct page *page)
+{
+	struct super_block *sb = inode->i_sb;
+	struct pnlfs_sb_info *sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+	struct pnlfs_inode_info *i_info;
+	__u8 data[PNLFS_INODE_DATA_SIZE];
+	uint32_t flags;
+	loff_t size;
+	int bno, ret = 0;
+
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	flags = i_info->flags;
+	bno = 0;
+	if (!(sb_info->features & PNLFS_FEATURE_EXTENTS)) {
+		bno = pnl_new_index(sb, inode, pnl_ino_goal(sb, inode->i_ino));
+		if (bno < 0)
+			return bno;
+	}
+	spin_lock(&i_info->data_lock);
+	memcpy(data, i_info->i_data, PNLFS_INODE_DATA_SIZE);
+	memset(i_info->i_data, 0, PNLFS_INODE_DATA_SIZE);
+	if (bno) {
+		i_info->index_block = bno;
+		i_info->flags = 0;
 	} else {
-		bidx = (*off) / PNLFS_BLOCK_SIZE;
-		w_start = (*off) % PNLFS_BLOCK_SIZE;
-	}
-
-	while(buf[s_len++] != '\0');
-	if (size < s_len)
-		s_len = size;
-	if (s_len == 0)
-		goto write_out;
-	pr_warn("buf = \"%s\", len = %ld\n", buf, strlen(buf));
-	//nr_entries = bidx + 1;
-	nr_entries = bidx;
-	while (s_len > 0) {
-		bno = pnl_find_index_block(file_index_block, bidx);
-		if (bno == PNLFS_MAX_BLOCKS_PER_FILE)
-		{
-			bno = pnl_new_index_block(inode->i_sb, inode);
-			file_index_block->blocks[bidx] = cpu_to_le32(bno);
-		}
-		bno = le32_to_cpu(file_index_block->blocks[bno]);
-		bh2 = sb_bread(inode->i_sb, bno);
-		w_end = w_start + s_len;
-		pr_warn("w_start = %d\n", w_start);
-		pr_warn("w_end = %d\n", w_end);
-		pr_warn("bidx = %d\n", bidx);
-		pr_warn("s_len = %d\n", s_len);
-		pr_warn("size = %ld\n", size);
-		if (w_end > PNLFS_BLOCK_SIZE) {
-			memcpy(bh2->b_data + w_start, buf + ret,
-					PNLFS_BLOCK_SIZE - w_start);
-			s_len -= (PNLFS_BLOCK_SIZE - w_start);
-			w_start = 0;
-			ret += (PNLFS_BLOCK_SIZE - w_start);
-			bidx++;
-		} else {
-			memcpy(bh2->b_data + w_start, buf + ret, s_len);
-			ret += s_len;
-			s_len = 0;
-		}
-		mark_buffer_dirty(bh2);
-		brelse(bh2);
-		nr_entries++;
-	}
-write_out :
-	i_info->nr_entries = nr_entries;
+		i_info->flags = PNLFS_INODE_EXTENTS;
+	}
+	spin_unlock(&i_info->data_lock);
+	size = i_size_read(inode);
+	if (size) {
+		ret = __block_write_begin(page, 0, size, pnl_get_block);
+		if (ret) {
+			if (i_info->flags & PNLFS_INODE_EXTENTS)
+				pnl_ext_free(inode);
+			else
+				pnl_free_index(inode);
+			goto unpack_restore;
+		}
+		block_commit_write(page, 0, size);
+	}
+	if (flags & PNLFS_INODE_FRAG)
+		pnl_put_frag(sb, (struct pnlfs_frag *) data);
+	mark_inode_dirty(inode);
+	return 0;
+
+unpack_restore:
+	kfree(i_info->extents);
+	i_info->extents = NULL;
+	i_info->nr_extents = 0;
+	spin_lock(&i_info->data_lock);
+	i_info->flags = flags;
+	memcpy(i_info->i_data, data, PNLFS_INODE_DATA_SIZE);
+	spin_unlock(&i_info->data_lock);
+	return ret;
+}
+
+/*
+ * Makes room for size bytes in a packed file, whose first page is locked and
+ * uptodate : its data moves to a fragment large enough, or to a data block
+ * past PNLFS_FRAG_MAX_SIZE or without PNLFS_FEATURE_TAIL_PACKING. Returns 1
+ * once the file is mapped by blocks.
+ */
+static int pnl_packed_grow(struct inode *inode, struct page *page,
+		loff_t size)
+{
+	struct super_block *sb = inode->i_sb;
+	struct pnlfs_sb_info *sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+	struct pnlfs_inode_info *i_info;
+	struct pnlfs_frag *frag, old;
+	struct buffer_head *bh;
+	uint32_t nr_slots, slot, flags;
+	size_t used;
+	void *kaddr;
+	__u8 *data;
+	int bno, ret;
+
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	if (size <= pnl_packed_room(i_info))
+		return 0;
+	if (!(sb_info->features & PNLFS_FEATURE_TAIL_PACKING) ||
+			size > PNLFS_FRAG_MAX_SIZE) {
+		ret = pnl_unpack_page(inode, page);
+		return ret ? ret : 1;
+	}
+
+	nr_slots = DIV_ROUND_UP(size, PNLFS_FRAG_SIZE);
+	bno = pnl_frag_alloc(sb, pnl_ino_goal(sb, inode->i_ino), nr_slots,
+			&slot);
+	if (bno < 0)
+		return bno;
+	bh = pnl_sb_bread(sb, bno);
+	if (!bh) {
+		pr_warn("[pnlfs] %s : error when opening block sector %d\n",
+				__func__, bno);
+		pnl_frag_free(sb, bno, slot, nr_slots);
+		return -EIO;
+	}
+	/* the slots may hold the data of a previously deleted file */
+	data = bh->b_data + slot * PNLFS_FRAG_SIZE;
+	used = min_t(loff_t, i_size_read(inode), pnl_packed_room(i_info));
+	kaddr = kmap_atomic(page);
+	memcpy(data, kaddr, used);
+	kunmap_atomic(kaddr);
+	memset(data + used, 0, nr_slots * PNLFS_FRAG_SIZE - used);
+	mark_buffer_dirty(bh);
+	brelse(bh);
+
+	flags = i_info->flags;
+	spin_lock(&i_info->data_lock);
+	memcpy(&old, i_info->i_data, sizeof(old));
+	memset(i_info->i_data, 0, PNLFS_INODE_DATA_SIZE);
+	frag = (struct pnlfs_frag *) i_info->i_data;
+	frag->block = cpu_to_le32(bno);
+	frag->slot = cpu_to_le16(slot);
+	frag->nr_slots = cpu_to_le16(nr_slots);
+	i_info->flags = PNLFS_INODE_FRAG;
+	spin_unlock(&i_info->data_lock);
+	if (flags & PNLFS_INODE_FRAG)
+		pnl_put_frag(sb, &old);
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+/*
+ * Moves a packed file to blocks, before it grows past what packing allows or
+ * gets blocks some other way.
+ */
+int pnl_unpack(struct inode *inode)
+{
+	struct page *page;
+	int ret = 0;
+
+	if (!pnl_is_packed(inode))
+		return 0;
+	page = find_or_create_page(inode->i_mapping, 0, GFP_NOFS);
+	if (!page)
+		return -ENOMEM;
+	if (pnl_is_packed(inode)) {
+		if (!PageUptodate(page))
+			ret = pnl_packed_fill(inode, page);
+		if (!ret)
+			ret = pnl_unpack_page(inode, page);
+	}
+	unlock_page(page);
+	put_page(page);
+	return ret;
+}
+
+int pnl_readpage(struct file *file, struct page *page)
+{
+	struct inode *inode = page->mapping->host;
+
+	int ret;
+
+	if (pnl_is_packed(inode)) {
+		ret = pnl_packed_fill(inode, page);
+		if (ret)
+			SetPageError(page);
+		unlock_page(page);
+		return ret;
+	}
+	return mpage_readpage(page, pnl_get_block);
+}
+
+/* Packed files are read by readpage */
+int pnl_readpages(struct file *file, struct address_space *mapping,
+		struct list_head *pages, unsigned nr_pages)
+{
+	if (pnl_is_packed(mapping->host))
+		return 0;
+	return mpage_readpages(mapping, pages, nr_pages, pnl_get_block);
+}
+
+int pnl_writepage(struct page *page, struct writeback_control *wbc)
+{
+	/* the data of a packed file is written with its inode or fragment */
+	if (pnl_is_packed(page->mapping->host)) {
+		unlock_page(page);
+		return 0;
+	}
+	return block_write_full_page(page, pnl_get_block, wbc);
+}
+
+int pnl_writepages(struct address_space *mapping,
+		struct writeback_control *wbc)
+{
+	if (pnl_is_packed(mapping->host))
+		return 0;
+	return mpage_writepages(mapping, wbc, pnl_get_block);
+}
+
+static void pnl_write_failed(struct address_space *mapping, loff_t to)
+{
+	struct inode *inode = mapping->host;
+
+	if (to > inode->i_size)
+		truncate_pagecache(inode, inode->i_size);
+}
+
+/*
+ * O_DIRECT transfers go between the user pages and the blocks mapped by
+ * pnl_get_block, without the page cache.
+ */
+ssize_t pnl_direct_IO(struct kiocb *iocb, struct iov_iter *iter)
+{
+	struct address_space *mapping = iocb->ki_filp->f_mapping;
+	size_t count = iov_iter_count(iter);
+	loff_t pos = iocb->ki_pos;
+	ssize_t ret;
+
+	/*
+	 * Packed files have no block to transfer to, they are left as they
+	 * are : returning 0 makes the VFS go through the page cache for the
+	 * whole request, where a write past the packed room moves the file to
+	 * a block like any buffered write.
+	 */
+	if (pnl_is_packed(mapping->host))
+		return 0;
+	ret = blockdev_direct_IO(iocb, mapping->host, iter, pnl_get_block);
+	if (ret < 0 && iov_iter_rw(iter) == WRITE)
+		pnl_write_failed(mapping, pos + count);
+	return ret;
+}
+
+int pnl_write_begin(struct file *file, struct address_space *mapping,
+		loff_t pos, unsigned len, unsigned flags,
+		struct page **pagep, void **fsdata)
+{
+	struct inode *inode = mapping->host;
+	struct page *page;
+	int ret;
+
+	if (pnl_is_packed(inode) && pos + len <= PNLFS_BLOCK_SIZE) {
+		page = grab_cache_page_write_begin(mapping, 0, flags);
+		if (!page)
+			return -ENOMEM;
+		if (pnl_is_packed(inode)) {
+			ret = 0;
+			if (!PageUptodate(page))
+				ret = pnl_packed_fill(inode, page);
+			if (!ret)
+				ret = pnl_packed_grow(inode, page, pos + len);
+			/* the page is already locked if it had to move */
+			if (ret == 1)
+				ret = __block_write_begin(page, pos, len,
+						pnl_get_block);
+			if (!ret) {
+				*pagep = page;
+				return 0;
+			}
+			unlock_page(page);
+			put_page(page);
+			pnl_write_failed(mapping, pos + len);
+			return ret;
+		}
+		unlock_page(page);
+		put_page(page);
+	}
+	ret = pnl_unpack(inode);
+	if (ret)
+		return ret;
+	ret = block_write_begin(mapping, pos, len, flags, pagep,
+			pnl_get_block);
+	if (unlikely(ret))
+		pnl_write_failed(mapping, pos + len);
+	return ret;
+}
+
+int pnl_write_end(struct file *file, struct address_space *mapping,
+		loff_t pos, unsigned len, unsigned copied,
+		struct page *page, void *fsdata)
+{
+	struct inode *inode = mapping->host;
+	struct pnlfs_inode_info *i_info;
+	struct buffer_head *bh = NULL;
+	__u8 *data;
+	void *kaddr;
+	int ret;
+
+	/* the page is left clean, the inode or the fragment carries the data */
+	if (pnl_is_packed(inode)) {
+		ret = copied;
+		data = copied ? pnl_packed_data(inode, &bh) : NULL;
+		if (IS_ERR(data)) {
+			ret = PTR_ERR(data);
+			ClearPageUptodate(page);
+		} else if (copied) {
+			i_info = container_of(inode, struct pnlfs_inode_info,
+					vfs_inode);
+			kaddr = kmap_atomic(page);
+			spin_lock(&i_info->data_lock);
+			memcpy(data + pos, kaddr + pos, copied);
+			spin_unlock(&i_info->data_lock);
+			kunmap_atomic(kaddr);
+			if (bh)
+				mark_buffer_dirty(bh);
+			brelse(bh);
+			if (pos + copied > inode->i_size)
+				i_size_write(inode, pos + copied);
+		}
+		unlock_page(page);
+		put_page(page);
+		mark_inode_dirty(inode);
+		return ret;
+	}
+	ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
+	if (ret < len)
+		pnl_write_failed(mapping, pos + len);
+	return ret;
+}
+
+sector_t pnl_bmap(struct address_space *mapping, sector_t block)
+{
+	return generic_block_bmap(mapping, block, pnl_get_block);
+}
+
+ssize_t pnl_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	loff_t pos = iocb->ki_pos;
+	ssize_t ret;
+
+	ret = generic_file_read_iter(iocb, to);
+	trace_pnlfs_read(file_inode(iocb->ki_filp), pos, ret);
+	pnl_stat_inc(file_inode(iocb->ki_filp)->i_sb, PNL_STAT_READS);
+	if (ret > 0)
+		pnl_stat_add(file_inode(iocb->ki_filp)->i_sb,
+				PNL_STAT_READ_BYTES, ret);
+	return ret;
+}
+
+ssize_t pnl_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	loff_t pos = iocb->ki_pos;
+	ssize_t ret;
+
+	ret = generic_file_write_iter(iocb, from);
+	/* pos is only known for O_APPEND once written */
+	trace_pnlfs_write(file_inode(iocb->ki_filp),
+			ret > 0 ? iocb->ki_pos - ret : pos, ret);
+	pnl_stat_inc(file_inode(iocb->ki_filp)->i_sb, PNL_STAT_WRITES);
+	if (ret > 0)
+		pnl_stat_add(file_inode(iocb->ki_filp)->i_sb,
+				PNL_STAT_WRITE_BYTES, ret);
+	return ret;
+}
+
+/*
+ * The block of a fragment is shared by several files, it is written here
+ * rather than put on the buffer list of one of them.
+ */
+int pnl_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+	struct inode *inode = file_inode(file);
+	struct pnlfs_inode_info *i_info;
+	struct pnlfs_frag *frag;
+	struct buffer_head *bh;
+	uint32_t bno = 0;
+	int ret;
+
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	frag = (struct pnlfs_frag *) i_info->i_data;
+	inode_lock(inode);
+	if (i_info->flags & PNLFS_INODE_FRAG)
+		bno = le32_to_cpu(frag->block);
+	inode_unlock(inode);
+	if (bno) {
+		bh = pnl_sb_bread(inode->i_sb, bno);
+		if (!bh) {
+			pr_warn("[pnlfs] %s : error when opening block sector %d\n",
+					__func__, bno);
+			return -EIO;
+		}
+		ret = sync_dirty_buffer(bh);
+		brelse(bh);
+		if (ret)
+			return ret;
+	}
+	return generic_file_fsync(file, start, end, datasync);
+}
+
+/* Faults wait for a hole punch, whose blocks are being freed, to end */
+int pnl_filemap_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct pnlfs_inode_info *i_info;
+	int ret;
+
+	i_info = container_of(file_inode(vma->vm_file),
+			struct pnlfs_inode_info, vfs_inode);
+	down_read(&i_info->map_sem);
+	ret = filemap_fault(vma, vmf);
+	up_read(&i_info->map_sem);
+	return ret;
+}
+
+/*
+ * A shared mapping dirties pages without going through write_begin : the
+ * blocks under a page are allocated, holes included, when it is first
+ * written to.
+ */
+int pnl_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct inode *inode = file_inode(vma->vm_file);
+	struct pnlfs_inode_info *i_info;
+	int ret;
+
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	sb_start_pagefault(inode->i_sb);
+	file_update_time(vma->vm_file);
+	down_read(&i_info->map_sem);
+	ret = pnl_unpack(inode);
+	if (!ret)
+		ret = block_page_mkwrite(vma, vmf, pnl_get_block);
+	up_read(&i_info->map_sem);
+	sb_end_pagefault(inode->i_sb);
+	return block_page_mkwrite_return(ret);
+}
+
+int pnl_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	file_accessed(file);
+	vma->vm_ops = &pnl_file_vm_ops;
+	return 0;
+}
+
+/* Returns whether iblock of inode is on disk, a hole reading as zeroes */
+static bool pnl_block_mapped(struct inode *inode, sector_t iblock)
+{
+	struct buffer_head map;
+
+	map.b_state = 0;
+	map.b_size = 1 << inode->i_blkbits;
+	return !pnl_get_block(inode, iblock, &map, 0) && buffer_mapped(&map);
+}
+
+/*
+ * Copies len bytes from file_in to file_out, both on the same pnlfs, from
+ * one page cache to the other without a pipe or a user buffer. The blocks of
+ * file_out are allocated by write_begin like for a write(), except for the
+ * holes of file_in copied past the end of file_out, which are kept as holes.
+ * Both inodes are locked, so that the size of file_in stays the one the copy
+ * was clamped to.
+ */
+ssize_t pnl_copy_file_range(struct file *file_in, loff_t pos_in,
+		struct file *file_out, loff_t pos_out, size_t len,
+		unsigned int flags)
+{
+	struct inode *src = file_inode(file_in);
+	struct inode *dst = file_inode(file_out);
+	struct address_space *mapping = file_out->f_mapping;
+	struct page *page, *dst_page;
+	void *fsdata, *from, *to;
+	size_t copied = 0, n;
+	loff_t size;
+	ssize_t ret = 0;
+
+	if (src->i_sb != dst->i_sb)
+		return -EXDEV;
+	/* overlapping copies within a file are left to splice */
+	if (src == dst)
+		return -EOPNOTSUPP;
+
+	lock_two_nondirectories(src, dst);
+	size = i_size_read(src);
+	if (pos_in >= size)
+		goto copy_out;
+	len = min_t(loff_t, len, size - pos_in);
+	if (pos_out >= dst->i_sb->s_maxbytes) {
+		ret = -EFBIG;
+		goto copy_out;
+	}
+	len = min_t(loff_t, len, dst->i_sb->s_maxbytes - pos_out);
+	ret = file_remove_privs(file_out);
+	if (!ret)
+		ret = file_update_time(file_out);
+	if (ret)
+		goto copy_out;
+
+	while (copied < len) {
+		n = min_t(size_t, len - copied,
+			  PAGE_SIZE - (pos_in & ~PAGE_MASK));
+		n = min_t(size_t, n, PAGE_SIZE - (pos_out & ~PAGE_MASK));
+		if (n == PAGE_SIZE && pos_out >= i_size_read(dst) &&
+				!pnl_block_mapped(src, pos_in >> PAGE_SHIFT))
+			goto copy_next;
+
+		page = read_mapping_page(file_in->f_mapping,
+				pos_in >> PAGE_SHIFT, file_in);
+		if (IS_ERR(page)) {
+			ret = PTR_ERR(page);
+			break;
+		}
+		ret = pagecache_write_begin(file_out, mapping, pos_out, n, 0,
+				&dst_page, &fsdata);
+		if (ret) {
+			put_page(page);
+			break;
+		}
+		from = kmap_atomic(page);
+		to = kmap_atomic(dst_page);
+		memcpy(to + (pos_out & ~PAGE_MASK),
+		       from + (pos_in & ~PAGE_MASK), n);
+		kunmap_atomic(to);
+		kunmap_atomic(from);
+		flush_dcache_page(dst_page);
+		ret = pagecache_write_end(file_out, mapping, pos_out, n, n,
+				dst_page, fsdata);
+		put_page(page);
+		if (ret <= 0)
+			break;
+		/* a short copy only goes as far as write_end took it */
+		n = ret;
+		balance_dirty_pages_ratelimited(mapping);
+copy_next:
+		pos_in += n;
+		pos_out += n;
+		copied += n;
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+		cond_resched();
+	}
+	/* trailing holes only moved the end of the file */
+	if (pos_out > i_size_read(dst)) {
+		i_size_write(dst, pos_out);
+		mark_inode_dirty(dst);
+	}
+copy_out:
+	unlock_two_nondirectories(src, dst);
+	return copied ? copied : ret;
+}
+
+/* Records in the superblock that index entries may now be unwritten */
+static int pnl_set_unwritten(struct super_block *sb)
+{
+	struct pnlfs_sb_info *sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+	struct pnlfs_superblock *raw_sb;
+	struct buffer_head *bh;
+
+	if (sb_info->features & PNLFS_FEATURE_UNWRITTEN)
+		return 0;
+	bh = pnl_sb_bread(sb, PNLFS_SB_BLOCK_NR);
+	if (!bh) {
+		pr_warn("[pnlfs] %s : error when opening block sector %d\n",
+				__func__, PNLFS_SB_BLOCK_NR);
+		return -EIO;
+	}
+	raw_sb = (struct pnlfs_superblock *) bh->b_data;
+	lock_buffer(bh);
+	sb_info->features |= PNLFS_FEATURE_UNWRITTEN;
+	raw_sb->features = cpu_to_le32(sb_info->features);
+	unlock_buffer(bh);
 	mark_buffer_dirty(bh);
 	brelse(bh);
-	(*off) += ret;
-	filp->f_pos = (*off);
-	inode->i_size = (*off);
+	return 0;
+}
+
+/*
+ * Reserves the blocks from offset to offset + len as runs of contiguous
+ * blocks, recorded as unwritten in the index or in the extents. The mapping
+ * is looked up first, so that the runs only cover the holes and the blocks
+ * already mapped are left as they are.
+ */
+static int pnl_prealloc(struct inode *inode, loff_t offset, loff_t len,
+		int mode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct pnlfs_sb_info *sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+	struct pnlfs_inode_info *i_info;
+	sector_t iblock = offset >> inode->i_blkbits;
+	sector_t last = (offset + len - 1) >> inode->i_blkbits;
+	uint32_t goal = 0, count, i;
+	int bno, ret;
+
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	/* the block numbers of an index must leave the unwritten bit free */
+	if (!(i_info->flags & PNLFS_INODE_EXTENTS) &&
+	    sb_info->nr_blocks > PNLFS_INDEX_UNWRITTEN)
+		return -EOPNOTSUPP;
+	if (!(mode & FALLOC_FL_KEEP_SIZE)) {
+		ret = inode_newsize_ok(inode, offset + len);
+		if (ret)
+			return ret;
+	}
+	ret = pnl_set_unwritten(sb);
+	if (ret)
+		return ret;
+
+	/* the runs follow the blocks of the file before them */
+	if (iblock) {
+		ret = pnl_block_reserved(inode, iblock - 1);
+		if (ret < 0)
+			return ret;
+		if (ret)
+			goal = ret + 1;
+	}
+	while (iblock <= last) {
+		ret = pnl_block_reserved(inode, iblock);
+		if (ret < 0)
+			return ret;
+		if (ret) {
+			goal = ret + 1;
+			iblock++;
+			continue;
+		}
+		for (count = 1; count < PNLFS_INDEX_ENTRIES &&
+			    iblock + count <= last; count++) {
+			ret = pnl_block_reserved(inode, iblock + count);
+			if (ret < 0)
+				return ret;
+			if (ret)
+				break;
+		}
+		bno = pnl_alloc_blocks(sb, goal, &count);
+		if (bno < 0)
+			return bno;
+		for (i = 0; i < count; i++, iblock++) {
+			ret = pnl_prealloc_block(inode, iblock, bno + i);
+			if (ret <= 0)
+				pnl_free_block(sb, bno + i);
+			if (ret < 0)
+				break;
+		}
+		if (ret < 0) {
+			while (++i < count)
+				pnl_free_block(sb, bno + i);
+			return ret;
+		}
+		goal = bno + count;
+		cond_resched();
+	}
+
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && offset + len > inode->i_size) {
+		i_size_write(inode, offset + len);
+		inode->i_ctime = CURRENT_TIME;
+		mark_inode_dirty(inode);
+	}
+	return 0;
+}
+
+/* Zeroes the bytes from to to of a block on disk, through its page */
+static int pnl_zero_partial(struct inode *inode, loff_t from, loff_t to)
+{
+	struct page *page;
+
+	if (from >= to || !pnl_block_mapped(inode, from >> inode->i_blkbits))
+		return 0;
+	page = read_mapping_page(inode->i_mapping, from >> PAGE_SHIFT, NULL);
+	if (IS_ERR(page))
+		return PTR_ERR(page);
+	lock_page(page);
+	zero_user(page, from & ~PAGE_MASK, to - from);
+	set_page_dirty(page);
+	unlock_page(page);
+	put_page(page);
+	return 0;
+}
+
+/*
+ * Frees the blocks wholly inside the hole, past the end of the file as well,
+ * whose pages are dropped, and zeroes the parts of the blocks at its edges
+ * which lie below i_size. The size of the file is left as it is. Faults are
+ * kept out while the blocks are freed, and the pages read back meanwhile by
+ * read() are dropped once they are, so that no page maps a freed block.
+ */
+static int pnl_punch_hole(struct inode *inode, loff_t offset, loff_t len)
+{
+	struct super_block *sb = inode->i_sb;
+	struct pnlfs_inode_info *i_info;
+	loff_t end = offset + len, size = i_size_read(inode);
+	loff_t lstart, lend;
+	sector_t first, last, iblock;
+	int ret;
+
+	first = (offset + sb->s_blocksize - 1) >> inode->i_blkbits;
+	last = end >> inode->i_blkbits;
+	if (first > last)
+		return pnl_zero_partial(inode, offset, min(end, size));
+	ret = pnl_zero_partial(inode, offset,
+			min((loff_t) first << inode->i_blkbits, size));
+	if (!ret)
+		ret = pnl_zero_partial(inode, (loff_t) last << inode->i_blkbits,
+				min(end, size));
+	if (ret || first == last)
+		goto punch_hole_out;
+
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	lstart = (loff_t) first << inode->i_blkbits;
+	lend = ((loff_t) last << inode->i_blkbits) - 1;
+	down_write(&i_info->map_sem);
+	truncate_pagecache_range(inode, lstart, lend);
+	for (iblock = first; iblock < last; iblock++) {
+		ret = pnl_unmap_block(inode, iblock);
+		if (ret < 0)
+			break;
+		if (ret)
+			pnl_free_block(sb, ret);
+		ret = 0;
+		cond_resched();
+	}
+	truncate_pagecache_range(inode, lstart, lend);
+	up_write(&i_info->map_sem);
+punch_hole_out:
+	inode->i_mtime = inode->i_ctime = CURRENT_TIME;
 	mark_inode_dirty(inode);
 	return ret;
 }
 
+/*
+ * Preallocated blocks are unwritten until first written to : index entries
+ * flag them with PNLFS_INDEX_UNWRITTEN, extents with PNLFS_EXTENT_UNWRITTEN
+ * in their length, which is never above PNLFS_EXTENT_MAX_LEN.
+ */
+long pnl_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
+{
+	struct inode *inode = file_inode(file);
+	long ret;
+
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+		return -EOPNOTSUPP;
 
+	inode_lock(inode);
+	/* both work on blocks */
+	ret = pnl_unpack(inode);
+	if (ret)
+		goto fallocate_out;
+	if (mode & FALLOC_FL_PUNCH_HOLE)
+		ret = pnl_punch_hole(inode, offset, len);
+	else
+		ret = pnl_prealloc(inode, offset, len, mode);
+fallocate_out:
+	inode_unlock(inode);
+	return ret;
+}
@@ -1,9 +1,38 @@
 #ifndef _PNL_IFOPS_H
 #define _PNL_IFOPS_H
 int pnl_readdir(struct file *file, struct dir_context *ctx);
-ssize_t pnl_read(struct file *filp, char __user *buf, size_t size,
-		loff_t *off);
-ssize_t pnl_write(struct file *filp, const char __user *buf, size_t size,
-		loff_t *off);
+void pnl_drop_index_cache(struct pnlfs_inode_info *i_info);
+int pnl_new_index(struct super_block *sb, struct inode *inode,
+		uint32_t goal);
+int pnl_map_block(struct inode *inode, sector_t iblock, int create, int *new);
+void pnl_free_index(struct inode *inode);
+int pnl_unpack(struct inode *inode);
+void pnl_free_frag(struct inode *inode);
+int pnl_get_block(struct inode *inode, sector_t iblock,
+		struct buffer_head *bh_result, int create);
+int pnl_readpage(struct file *file, struct page *page);
+int pnl_readpages(struct file *file, struct address_space *mapping,
+		struct list_head *pages, unsigned nr_pages);
+int pnl_writepage(struct page *page, struct writeback_control *wbc);
+int pnl_writepages(struct address_space *mapping,
+		struct writeback_control *wbc);
+int pnl_write_begin(struct file *file, struct address_space *mapping,
+		loff_t pos, unsigned len, unsigned flags,
+		struct page **pagep, void **fsdata);
+int pnl_write_end(struct file *file, struct address_space *mapping,
+		loff_t pos, unsigned len, unsigned copied,
+		struct page *page, void *fsdata);
+sector_t pnl_bmap(struct address_space *mapping, sector_t block);
+ssize_t pnl_direct_IO(struct kiocb *iocb, struct iov_iter *iter);
+ssize_t pnl_file_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t pnl_file_write_iter(struct kiocb *iocb, struct iov_iter *from);
+int pnl_fsync(struct file *file, loff_t start, loff_t end, int datasync);
+int pnl_filemap_fault(struct vm_area_struct *vma, struct vm_fault *vmf);
+int pnl_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf);
+int pnl_file_mmap(struct file *file, struct vm_area_struct *vma);
+ssize_t pnl_copy_file_range(struct file *file_in, loff_t pos_in,
+		struct file *file_out, loff_t pos_out, size_t len,
+		unsigned int flags);
+long pnl_fallocate(struct file *file, int mode, loff_t offset, loff_t len);
 
 #endif
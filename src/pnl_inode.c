@@ -2,174 +2,330 @@
 #include <linux/dcache.h>
 #include <linux/writeback.h>
 #include <linux/buffer_head.h>
+#include <linux/pagemap.h>
+#include <linux/mm.h>
 #include <linux/slab.h>
 #include <uapi/asm-generic/errno-base.h>
 #include <uapi/asm-generic/errno.h>
 #include <uapi/linux/stat.h>
 #include <uapi/linux/fs.h>
 #include "pnlfs.h"
+#include "pnl_stats.h"
 #include "pnl_iops.h"
 #include "pnl_ifops.h"
+#include "pnl_inode.h"
+#include "pnl_dir.h"
+#include "pnl_alloc.h"
+#include "pnl_extents.h"
+#include "pnl_trace.h"
 
 const struct inode_operations pnl_iops = {
 	.lookup = pnl_lookup,
 	.create = pnl_create,
 	.mkdir  = pnl_mkdir,
 	.unlink = pnl_unlink,
+	.rmdir  = pnl_rmdir,
 	.rename = pnl_rename,
 };
 
 struct file_operations pnl_ifops = {
 	.owner = THIS_MODULE,
+	.llseek = generic_file_llseek,
+	.read_iter = pnl_file_read_iter,
+	.write_iter = pnl_file_write_iter,
+	.mmap = pnl_file_mmap,
+	.fsync = pnl_fsync,
+	.splice_read = generic_file_splice_read,
+	.splice_write = iter_file_splice_write,
+	.copy_file_range = pnl_copy_file_range,
+	.fallocate = pnl_fallocate,
+};
+
+const struct vm_operations_struct pnl_file_vm_ops = {
+	.fault = pnl_filemap_fault,
+	.map_pages = filemap_map_pages,
+	.page_mkwrite = pnl_page_mkwrite,
+};
+
+struct file_operations pnl_dir_ifops = {
+	.owner = THIS_MODULE,
+	.llseek = generic_file_llseek,
+	.read = generic_read_dir,
 	.iterate_shared = pnl_readdir,
-	.read = pnl_read,
-	.write = pnl_write,
 };
 
-struct inode *pnl_alloc_inode(struct super_block *sb)
+const struct address_space_operations pnl_aops = {
+	.readpage = pnl_readpage,
+	.readpages = pnl_readpages,
+	.writepage = pnl_writepage,
+	.writepages = pnl_writepages,
+	.write_begin = pnl_write_begin,
+	.write_end = pnl_write_end,
+	.bmap = pnl_bmap,
+	.direct_IO = pnl_direct_IO,
+};
+
+/*
+ * Directories and regular files don't share their file operations : the data
+ * of regular files goes through the page cache, directories are only walked
+ * by readdir.
+ */
+void pnl_set_inode_ops(struct inode *inode)
 {
-	struct pnlfs_inode_info *i_info = (struct pnlfs_inode_info *) kmalloc
-		(sizeof(struct pnlfs_inode_info), GFP_KERNEL);
-	if(!i_info)
-		return ERR_PTR(-ENOMEM);
+	inode->i_op = &pnl_iops;
+	if (S_ISDIR(inode->i_mode)) {
+		inode->i_fop = &pnl_dir_ifops;
+	} else {
+		inode->i_fop = &pnl_ifops;
+		inode->i_mapping->a_ops = &pnl_aops;
+	}
+}
+
+/*
+ * Inodes come from pnl_inode_cachep, whose constructor only runs when a slab
+ * object is created : the locks and the vfs inode are initialized once, the
+ * caches of an inode are dropped when it is destroyed.
+ */
+void pnl_init_once(void *foo)
+{
+	struct pnlfs_inode_info *i_info = (struct pnlfs_inode_info *) foo;
+
+	mutex_init(&i_info->index_lock);
+	init_rwsem(&i_info->map_sem);
+	spin_lock_init(&i_info->data_lock);
+	init_rwsem(&i_info->dir_sem);
+	memset(i_info->index_cache, 0, sizeof(i_info->index_cache));
+	i_info->extents = NULL;
+	i_info->nr_extents = 0;
+	i_info->dir_cache = NULL;
 	inode_init_once(&i_info->vfs_inode);
+}
+
+struct inode *pnl_alloc_inode(struct super_block *sb)
+{
+	struct pnlfs_inode_info *i_info;
+
+	i_info = kmem_cache_alloc(pnl_inode_cachep, GFP_KERNEL);
+	if (!i_info)
+		return NULL;
 	return &i_info->vfs_inode;
 }
 
+static void pnl_i_callback(struct rcu_head *head)
+{
+	struct inode *inode = container_of(head, struct inode, i_rcu);
+
+	kmem_cache_free(pnl_inode_cachep,
+			container_of(inode, struct pnlfs_inode_info, vfs_inode));
+}
+
+/* RCU path walk may still look at the inode until a grace period ends */
 void pnl_destroy_inode(struct inode *inode)
 {
-	kfree(container_of(inode, struct pnlfs_inode_info, vfs_inode));
+	struct pnlfs_inode_info *i_info;
+
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	pnl_drop_index_cache(i_info);
+	pnl_dir_drop_cache(i_info);
+	kfree(i_info->extents);
+	i_info->extents = NULL;
+	i_info->nr_extents = 0;
+	call_rcu(&inode->i_rcu, pnl_i_callback);
+}
+
+/* Fills a new inode from its raw inode */
+static void pnl_fill_inode(struct inode *inode, struct pnlfs_inode *raw_inode)
+{
+	struct pnlfs_sb_info *sb_info;
+	struct pnlfs_inode_large *raw_large;
+	struct pnlfs_inode_info *i_info;
+
+	sb_info = (struct pnlfs_sb_info *) inode->i_sb->s_fs_info;
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	inode->i_mode = le32_to_cpu(raw_inode->mode);
+	inode->i_size = le32_to_cpu(raw_inode->filesize);
+	inode->i_blocks = le32_to_cpu(raw_inode->nr_used_blocks);
+	i_info->index_block = le32_to_cpu(raw_inode->index_block);
+	i_info->nr_entries = le32_to_cpu(raw_inode->nr_entries);
+	i_info->released = false;
+	if (sb_info->inode_size == PNLFS_LARGE_INODE_SIZE) {
+		raw_large = (struct pnlfs_inode_large *) raw_inode;
+		i_info->flags = le32_to_cpu(raw_large->flags);
+		inode->i_size |= (loff_t) le32_to_cpu(raw_large->filesize_hi)
+			<< 32;
+		memcpy(i_info->i_data, raw_large->data, PNLFS_INODE_DATA_SIZE);
+	} else {
+		i_info->flags = 0;
+	}
+	pnl_set_inode_ops(inode);
+
+	inode->i_atime = inode->i_mtime = inode->i_ctime = CURRENT_TIME;
+	trace_pnlfs_iget(inode);
+	pnl_debug("%s : ino %ld mode %o size %lld index_block %d\n",
+			__func__, inode->i_ino, inode->i_mode, inode->i_size,
+			i_info->index_block);
 }
 
 struct inode *pnl_iget(struct super_block *sb, unsigned long ino)
 {
-	uint32_t bno, sno;
+	uint32_t bno, offset;
+	int ret;
 	struct buffer_head *bh;
 	struct inode *inode;
-	struct pnlfs_inode *raw_inode;
-	struct pnlfs_inode_info *i_info;
 
 	inode = iget_locked(sb, ino);
-	if (!inode) {
-		pr_warn("[pnlfs] --- iget() ---\n");
-		pr_warn("[pnlfs] No more memory to allocate an inode\n");
-		iget_failed(inode);
+	if (!inode)
 		return ERR_PTR(-ENOMEM);
-	}
 	else if (!(inode->i_state & I_NEW))
 		return inode;
 
-	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
-	bno = ino / (PNLFS_BLOCK_SIZE / sizeof(struct pnlfs_inode)) + 1;
-	sno = ino % (PNLFS_BLOCK_SIZE / sizeof(struct pnlfs_inode));
-	inode->i_op = &pnl_iops;
-	inode->i_fop = &pnl_ifops;
+	ret = pnl_inode_block(sb, ino, &offset);
+	if (ret < 0) {
+		iget_failed(inode);
+		return ERR_PTR(ret);
+	}
+	bno = ret;
 	inode->i_sb = sb;
 	inode->i_ino = ino;
-	bh = sb_bread(sb, bno);
-	raw_inode = (struct pnlfs_inode *)&bh->b_data[sno];
-	inode->i_mode = le32_to_cpu(raw_inode->mode);
-	inode->i_size = le32_to_cpu(raw_inode->filesize);
-	inode->i_blocks = le32_to_cpu(raw_inode->nr_used_blocks);
-	i_info->index_block = le32_to_cpu(raw_inode->index_block);
-	i_info->nr_entries = le32_to_cpu(raw_inode->nr_entries);
+	bh = pnl_sb_bread(sb, bno);
+	if (!bh) {
+		pr_warn("[pnlfs] %s : error when opening block sector %d\n",
+				__func__, bno);
+		iget_failed(inode);
+		return ERR_PTR(-EIO);
+	}
+	pnl_fill_inode(inode, (struct pnlfs_inode *) &bh->b_data[offset]);
 	brelse(bh);
-
-	inode->i_atime = inode->i_mtime = inode->i_ctime = CURRENT_TIME;
-	pr_info("[pnlfs] pnl_iget() : success\n");
-	pr_info("[pnlfs] inode : <%p>\n", inode);
-	pr_info("[pnlfs] i_info : <%p>\n", i_info);
-	pr_info("[pnlfs] i_mode : %d\n", inode->i_mode);
-	pr_info("[pnlfs] i_ino : %ld\n", inode->i_ino);
-	pr_info("[pnlfs] i_size : %lld\n", inode->i_size);
-	pr_info("[pnlfs] i_blocks : %ld\n", inode->i_blocks);
-	pr_info("[pnlfs] index_block : %d\n", i_info->index_block);
-	pr_info("[pnlfs] nr_entries : %d\n", i_info->nr_entries);
 	unlock_new_inode(inode);
 	return inode;
 }
 
+/*
+ * Brings the inodes of the nr entries of files in the inode cache, so that
+ * the stat() calls following a readdir() don't go through the inode store
+ * one inode at a time. Nothing is read here, only the inodes whose block is
+ * already up to date in the buffer cache are filled, the others are left to
+ * pnl_iget().
+ */
+void pnl_iget_batch(struct super_block *sb, struct pnlfs_file *files,
+		uint32_t nr)
+{
+	struct buffer_head *bh = NULL;
+	struct inode *inode;
+	uint32_t i, ino, offset;
+	int bno, last = -1;
+
+	for (i = 0; i < nr; i++) {
+		if (!files[i].inode)
+			continue;
+		ino = le32_to_cpu(files[i].inode);
+		bno = pnl_inode_block(sb, ino, &offset);
+		if (bno < 0)
+			continue;
+		/* siblings mostly share their blocks */
+		if (bno != last) {
+			brelse(bh);
+			last = bno;
+			bh = sb_find_get_block(sb, bno);
+			if (bh && !buffer_uptodate(bh)) {
+				brelse(bh);
+				bh = NULL;
+			}
+		}
+		if (!bh)
+			continue;
+		inode = iget_locked(sb, ino);
+		if (!inode)
+			continue;
+		if (inode->i_state & I_NEW) {
+			pnl_fill_inode(inode,
+				(struct pnlfs_inode *) &bh->b_data[offset]);
+			unlock_new_inode(inode);
+		}
+		/* left in the inode cache, unused */
+		iput(inode);
+	}
+	brelse(bh);
+}
+
+/*
+ * Copies inode to its raw inode, in the buffer of its inode table block. The
+ * buffer is left to the flusher, which writes the inodes sharing a block all
+ * at once, unless the caller waits for this very inode outside of a sync.
+ */
 int pnl_write_inode(struct inode *inode, struct writeback_control *wbc)
 {
-	int wait = 1;
-	//int wait = (wbc->sync_mode == WB_SYNC_ALL);
-	struct buffer_head *bh, *bh2;
+	struct buffer_head *bh;
 	struct pnlfs_inode *raw_inode;
+	struct pnlfs_inode_large *raw_large;
 	struct super_block *sb = inode->i_sb;
+	struct pnlfs_sb_info *sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
 	struct pnlfs_inode_info *i_info;
-	struct pnlfs_file_index_block *file_index_block;
-	ino_t ino = inode->i_ino;
-	u32 bno, sno, i;
-
-	inode_lock(inode);
-	bno = ino / (PNLFS_BLOCK_SIZE / sizeof(struct pnlfs_inode)) + 1;
-	sno = ino % (PNLFS_BLOCK_SIZE / sizeof(struct pnlfs_inode));
-	bh = sb_bread(sb, bno);
+	u32 bno, offset;
+	int ret;
+
+	ret = pnl_inode_block(sb, inode->i_ino, &offset);
+	if (ret < 0)
+		return ret;
+	bno = ret;
+	bh = pnl_sb_bread(sb, bno);
+	if (!bh) {
+		pr_warn("[pnlfs] %s : error when opening block sector %d\n",
+				__func__, bno);
+		return -EIO;
+	}
 	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
-	raw_inode = (struct pnlfs_inode *)&bh->b_data[sno];
-	//raw_inode->mode = 0;
-	//raw_inode->filesize = 0;
-	//raw_inode->index_block = 0;
-	//raw_inode->nr_entries = 0;
+	raw_inode = (struct pnlfs_inode *) &bh->b_data[offset];
 	raw_inode->mode = cpu_to_le32((uint32_t) inode->i_mode);
 	raw_inode->filesize = cpu_to_le32((uint32_t) inode->i_size);
 	raw_inode->index_block = cpu_to_le32((uint32_t) i_info->index_block);
 	raw_inode->nr_entries = cpu_to_le32((uint32_t) i_info->nr_entries);
-	pr_warn("[pnlfs] %s : raw_inode->mode = %d\n",
-			__func__, le32_to_cpu(raw_inode->mode));
-	pr_warn("[pnlfs] %s : raw_inode->filesize = %d\n",
-			__func__, le32_to_cpu(raw_inode->filesize));
-	pr_warn("[pnlfs] %s : raw_inode->index_block = %d\n",
-			__func__, le32_to_cpu(raw_inode->index_block));
-	pr_warn("[pnlfs] %s : raw_inode->nr_entries = %d\n",
-			__func__, le32_to_cpu(raw_inode->nr_entries));
-	mark_buffer_dirty(bh);
-	if (wait) {
-		pr_warn("[pnlfs] %s : WAIT_ON\n", __func__);
-		if(sync_dirty_buffer(bh) != 0)
-			pr_warn("FAILURE\n");
+	if (sb_info->inode_size == PNLFS_LARGE_INODE_SIZE) {
+		raw_large = (struct pnlfs_inode_large *) raw_inode;
+		raw_large->filesize_hi = cpu_to_le32((uint32_t)
+				(inode->i_size >> 32));
+		/* packed data, extent roots and inline entries change anytime */
+		spin_lock(&i_info->data_lock);
+		raw_large->flags = cpu_to_le32(i_info->flags);
+		memcpy(raw_large->data, i_info->i_data, PNLFS_INODE_DATA_SIZE);
+		spin_unlock(&i_info->data_lock);
 	}
-	pr_warn("[pnlfs] %s : block sector %d successfully written\n",
-			__func__, bno);
-	brelse(bh);
-	bh = sb_bread(sb, i_info->index_block);
 	mark_buffer_dirty(bh);
-	if (wait) {
-		pr_warn("[pnlfs] %s : WAIT_ON\n", __func__);
-		if(sync_dirty_buffer(bh) != 0)
-			pr_warn("FAILURE\n");
-	}
-	pr_warn("[pnlfs] %s : block sector %d successfully written\n",
-			__func__, i_info->index_block);
-	if (S_ISREG(inode->i_mode))
-	{
-		file_index_block = (struct pnlfs_file_index_block *) bh->b_data;
-		for (i = 0; i < i_info->nr_entries; i++)
-		{
-			bno = le32_to_cpu(file_index_block->blocks[i]);
-			bh2 = sb_bread(sb, bno);
-			mark_buffer_dirty(bh2);
-			if (wait) {
-				pr_warn("[pnlfs] %s : WAIT_ON\n", __func__);
-				if(sync_dirty_buffer(bh2) != 0)
-					pr_warn("FAILURE\n");
-			}
-			pr_warn("[pnlfs] %s : block sector %d successfully written\n",
+	/* a sync writes the whole block device once all inodes are copied */
+	ret = 0;
+	if (wbc->sync_mode == WB_SYNC_ALL && !wbc->for_sync) {
+		sync_dirty_buffer(bh);
+		if (buffer_req(bh) && !buffer_uptodate(bh)) {
+			pr_warn("[pnlfs] %s : error when writing block sector %d\n",
 					__func__, bno);
-			brelse(bh2);
+			ret = -EIO;
 		}
 	}
 	brelse(bh);
-	pr_warn("[pnlfs] %s : inode <%p> ino %ld successfully written\n",
-			__func__, inode, inode->i_ino);
-	pr_info("[pnlfs] inode : <%p>\n", inode);
-	pr_info("[pnlfs] i_info : <%p>\n", i_info);
-	pr_info("[pnlfs] i_mode : %d\n", inode->i_mode);
-	pr_info("[pnlfs] i_ino : %ld\n", inode->i_ino);
-	pr_info("[pnlfs] i_size : %lld\n", inode->i_size);
-	pr_info("[pnlfs] i_blocks : %ld\n", inode->i_blocks);
-	pr_info("[pnlfs] index_block : %d\n", i_info->index_block);
-	pr_info("[pnlfs] nr_entries : %d\n", i_info->nr_entries);
-	inode_unlock(inode);
-	return 0;
+	return ret;
+}
+
+/*
+ * The page cache and the buffers of the index are dropped before the blocks
+ * of a released inode are freed, so that none of them is written over a
+ * block allocated again.
+ */
+void pnl_evict_inode(struct inode *inode)
+{
+	struct pnlfs_inode_info *i_info;
+
+	i_info = container_of(inode, struct pnlfs_inode_info, vfs_inode);
+	truncate_inode_pages_final(&inode->i_data);
+	invalidate_inode_buffers(inode);
+	if (i_info->released) {
+		if (i_info->flags & PNLFS_INODE_EXTENTS)
+			pnl_ext_free(inode);
+		else if (i_info->flags & PNLFS_INODE_FRAG)
+			pnl_free_frag(inode);
+		else
+			pnl_free_index(inode);
+		pnl_free_ino(inode->i_sb, inode->i_ino,
+				S_ISDIR(inode->i_mode));
+	}
+	clear_inode(inode);
 }
@@ -1,8 +1,16 @@
 #ifndef _PNL_INODE_H
 #define _PNL_INODE_H
+extern struct kmem_cache *pnl_inode_cachep;
+extern const struct vm_operations_struct pnl_file_vm_ops;
+void pnl_init_once(void *foo);
+void pnl_set_inode_ops(struct inode *inode);
 struct inode *pnl_iget(struct super_block *sb, unsigned long ino);
+struct pnlfs_file;
+void pnl_iget_batch(struct super_block *sb, struct pnlfs_file *files,
+		uint32_t nr);
 struct inode *pnl_alloc_inode(struct super_block *sb);
 void pnl_destroy_inode(struct inode *inode);
 int pnl_write_inode(struct inode *inode, struct writeback_control *wbc);
+void pnl_evict_inode(struct inode *inode);
 #endif
 
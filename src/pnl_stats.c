@@ -0,0 +1,138 @@
+#include <linux/fs.h>
+#include <linux/debugfs.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <uapi/asm-generic/errno-base.h>
+#include <uapi/asm-generic/errno.h>
+#include <uapi/linux/stat.h>
+#include "pnlfs.h"
+#include "pnl_alloc.h"
+#include "pnl_stats.h"
+
+static struct dentry *pnl_debugfs_root;
+
+static const char * const pnl_stat_names[PNL_NR_STATS] = {
+	[PNL_STAT_BLOCK_ALLOCS] = "block_allocs",
+	[PNL_STAT_BLOCK_GROUPS] = "block_alloc_groups",
+	[PNL_STAT_INODE_ALLOCS] = "inode_allocs",
+	[PNL_STAT_INODE_GROUPS] = "inode_alloc_groups",
+	[PNL_STAT_LOOKUP_HITS] = "lookup_hits",
+	[PNL_STAT_LOOKUP_MISSES] = "lookup_misses",
+	[PNL_STAT_LOOKUP_SCANNED] = "lookup_scanned",
+	[PNL_STAT_READS] = "reads",
+	[PNL_STAT_READ_BYTES] = "read_bytes",
+	[PNL_STAT_WRITES] = "writes",
+	[PNL_STAT_WRITE_BYTES] = "write_bytes",
+	[PNL_STAT_MAPPED_BLOCKS] = "mapped_blocks",
+	[PNL_STAT_BREADS] = "sb_breads",
+	[PNL_STAT_SYNCS] = "syncs",
+	[PNL_STAT_SYNC_NS] = "sync_ns",
+};
+
+static int pnl_stats_show(struct seq_file *m, void *v)
+{
+	struct super_block *sb = m->private;
+	struct pnl_stats *stats;
+	u64 sum;
+	int i, cpu;
+
+	for (i = 0; i < PNL_NR_STATS; i++) {
+		sum = 0;
+		for_each_possible_cpu(cpu) {
+			stats = per_cpu_ptr(PNL_STATS(sb), cpu);
+			sum += stats->count[i];
+		}
+		seq_printf(m, "%s %llu\n", pnl_stat_names[i],
+				(unsigned long long) sum);
+	}
+	return 0;
+}
+
+static int pnl_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, pnl_stats_show, inode->i_private);
+}
+
+static const struct file_operations pnl_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = pnl_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* Reads the bitmaps of the whole disk, so it is only done on demand */
+static int pnl_free_extents_show(struct seq_file *m, void *v)
+{
+	struct super_block *sb = m->private;
+	struct pnl_free_extents fe;
+	int err;
+
+	err = pnl_free_extents(sb, &fe);
+	if (err)
+		return err;
+	seq_printf(m, "free_blocks %llu\n"
+		   "free_extents %llu\n"
+		   "largest_extent %u\n",
+		   (unsigned long long) fe.nr_free,
+		   (unsigned long long) fe.nr_extents, fe.largest);
+	return 0;
+}
+
+static int pnl_free_extents_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, pnl_free_extents_show, inode->i_private);
+}
+
+static const struct file_operations pnl_free_extents_fops = {
+	.owner = THIS_MODULE,
+	.open = pnl_free_extents_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* A mount without debugfs entries still counts */
+int pnl_stats_init(struct super_block *sb)
+{
+	struct pnlfs_sb_info *sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+
+	sb_info->stats = alloc_percpu(struct pnl_stats);
+	if (!sb_info->stats)
+		return -ENOMEM;
+	if (!pnl_debugfs_root)
+		return 0;
+	sb_info->debugfs_dir = debugfs_create_dir(sb->s_id, pnl_debugfs_root);
+	if (IS_ERR_OR_NULL(sb_info->debugfs_dir)) {
+		sb_info->debugfs_dir = NULL;
+		return 0;
+	}
+	debugfs_create_file("stats", S_IRUSR, sb_info->debugfs_dir, sb,
+			&pnl_stats_fops);
+	debugfs_create_file("free_extents", S_IRUSR, sb_info->debugfs_dir, sb,
+			&pnl_free_extents_fops);
+	return 0;
+}
+
+void pnl_stats_exit(struct super_block *sb)
+{
+	struct pnlfs_sb_info *sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
+
+	debugfs_remove_recursive(sb_info->debugfs_dir);
+	sb_info->debugfs_dir = NULL;
+	free_percpu(sb_info->stats);
+	sb_info->stats = NULL;
+}
+
+void pnl_debugfs_init(void)
+{
+	pnl_debugfs_root = debugfs_create_dir("pnlfs", NULL);
+	if (IS_ERR(pnl_debugfs_root))
+		pnl_debugfs_root = NULL;
+}
+
+void pnl_debugfs_exit(void)
+{
+	debugfs_remove_recursive(pnl_debugfs_root);
+	pnl_debugfs_root = NULL;
+}
@@ -0,0 +1,51 @@
+#ifndef _PNL_STATS_H
+#define _PNL_STATS_H
+
+#include <linux/buffer_head.h>
+#include <linux/percpu.h>
+#include "pnlfs.h"
+
+/* Counters of a mount, see /sys/kernel/debug/pnlfs/<dev>/stats */
+enum pnl_stat {
+	PNL_STAT_BLOCK_ALLOCS,    /* Blocks allocated */
+	PNL_STAT_BLOCK_GROUPS,    /* Groups looked at to allocate them */
+	PNL_STAT_INODE_ALLOCS,    /* Inodes allocated */
+	PNL_STAT_INODE_GROUPS,    /* Groups looked at to allocate them */
+	PNL_STAT_LOOKUP_HITS,
+	PNL_STAT_LOOKUP_MISSES,
+	PNL_STAT_LOOKUP_SCANNED,  /* Entries compared by lookups */
+	PNL_STAT_READS,
+	PNL_STAT_READ_BYTES,
+	PNL_STAT_WRITES,
+	PNL_STAT_WRITE_BYTES,
+	PNL_STAT_MAPPED_BLOCKS,   /* Blocks mapped by get_block */
+	PNL_STAT_BREADS,          /* Blocks read with sb_bread() */
+	PNL_STAT_SYNCS,
+	PNL_STAT_SYNC_NS,         /* Time spent in sync_fs */
+	PNL_NR_STATS
+};
+
+struct pnl_stats {
+	u64 count[PNL_NR_STATS];
+};
+
+#define PNL_STATS(sb) (((struct pnlfs_sb_info *) (sb)->s_fs_info)->stats)
+
+/* Counters are per CPU, they are only summed when read */
+#define pnl_stat_add(sb, stat, n) \
+	this_cpu_add(PNL_STATS(sb)->count[stat], n)
+#define pnl_stat_inc(sb, stat) pnl_stat_add(sb, stat, 1)
+
+static inline struct buffer_head *pnl_sb_bread(struct super_block *sb,
+		sector_t block)
+{
+	pnl_stat_inc(sb, PNL_STAT_BREADS);
+	return sb_bread(sb, block);
+}
+
+int pnl_stats_init(struct super_block *sb);
+void pnl_stats_exit(struct super_block *sb);
+void pnl_debugfs_init(void);
+void pnl_debugfs_exit(void);
+
+#endif
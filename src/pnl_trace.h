@@ -0,0 +1,140 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM pnlfs
+
+#if !defined(_PNL_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _PNL_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Events of /sys/kernel/debug/tracing/events/pnlfs, which cost a static
+ * branch while disabled.
+ */
+
+TRACE_EVENT(pnlfs_iget,
+	TP_PROTO(struct inode *inode),
+	TP_ARGS(inode),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(ino_t, ino)
+		__field(umode_t, mode)
+		__field(loff_t, size)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->mode = inode->i_mode;
+		__entry->size = inode->i_size;
+	),
+	TP_printk("dev %d,%d ino %lu mode 0%o size %lld",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long) __entry->ino, __entry->mode, __entry->size)
+);
+
+TRACE_EVENT(pnlfs_read,
+	TP_PROTO(struct inode *inode, loff_t pos, ssize_t ret),
+	TP_ARGS(inode, pos, ret),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(ino_t, ino)
+		__field(loff_t, pos)
+		__field(ssize_t, ret)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->pos = pos;
+		__entry->ret = ret;
+	),
+	TP_printk("dev %d,%d ino %lu pos %lld ret %zd",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long) __entry->ino, __entry->pos, __entry->ret)
+);
+
+TRACE_EVENT(pnlfs_write,
+	TP_PROTO(struct inode *inode, loff_t pos, ssize_t ret),
+	TP_ARGS(inode, pos, ret),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(ino_t, ino)
+		__field(loff_t, pos)
+		__field(ssize_t, ret)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->pos = pos;
+		__entry->ret = ret;
+	),
+	TP_printk("dev %d,%d ino %lu pos %lld ret %zd",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long) __entry->ino, __entry->pos, __entry->ret)
+);
+
+TRACE_EVENT(pnlfs_alloc_block,
+	TP_PROTO(struct super_block *sb, uint32_t goal, int bno),
+	TP_ARGS(sb, goal, bno),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(uint32_t, goal)
+		__field(int, bno)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->goal = goal;
+		__entry->bno = bno;
+	),
+	TP_printk("dev %d,%d goal %u bno %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->goal, __entry->bno)
+);
+
+TRACE_EVENT(pnlfs_lookup,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, ino_t ino, int err),
+	TP_ARGS(dir, dentry, ino, err),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(ino_t, dir)
+		__string(name, dentry->d_name.name)
+		__field(ino_t, ino)
+		__field(int, err)
+	),
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__assign_str(name, dentry->d_name.name);
+		__entry->ino = ino;
+		__entry->err = err;
+	),
+	TP_printk("dev %d,%d dir %lu name %s ino %lu err %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long) __entry->dir, __get_str(name),
+		  (unsigned long) __entry->ino, __entry->err)
+);
+
+TRACE_EVENT(pnlfs_sync,
+	TP_PROTO(struct super_block *sb, int wait, int err),
+	TP_ARGS(sb, wait, err),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(int, wait)
+		__field(int, err)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->wait = wait;
+		__entry->err = err;
+	),
+	TP_printk("dev %d,%d wait %d err %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->wait, __entry->err)
+);
+
+#endif /* _PNL_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE pnl_trace
+#include <trace/define_trace.h>
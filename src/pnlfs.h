@@ -12,6 +12,47 @@
 #define PNLFS_MAX_DIR_ENTRIES        128
 #define PNLFS_MAX_BLOCKS_PER_FILE    1024
 
+/* Debug messages, only built with PNLFS_DEBUG=1, see the Makefile */
+#ifdef PNLFS_DEBUG
+#define pnl_debug(fmt, ...) pr_info("[pnlfs] " fmt, ##__VA_ARGS__)
+#else
+#define pnl_debug(fmt, ...) no_printk("[pnlfs] " fmt, ##__VA_ARGS__)
+#endif
+
+/* Optional features, see pnlfs_superblock.features */
+#define PNLFS_FEATURE_EXTENTS        0x0001  /* Files are mapped by extents */
+#define PNLFS_FEATURE_INDIRECT       0x0002  /* Index blocks end with indirect
+						blocks */
+#define PNLFS_FEATURE_DIR_INDEX      0x0004  /* Directories are hashed over
+						several blocks */
+#define PNLFS_FEATURE_FILETYPE       0x0008  /* Entries store the type of
+						their inode */
+#define PNLFS_FEATURE_BLOCK_GROUPS   0x0010  /* Disk split in block groups */
+#define PNLFS_FEATURE_UNWRITTEN      0x0020  /* Index entries and extents
+						may be preallocated, set by
+						the first fallocate() */
+#define PNLFS_FEATURE_INLINE_DATA    0x0040  /* Small files are stored in
+						their inode */
+#define PNLFS_FEATURE_TAIL_PACKING   0x0080  /* Small files share data
+						blocks */
+#define PNLFS_FEATURE_INLINE_DIR     0x0100  /* Small directories are stored
+						in their inode */
+#define PNLFS_FEATURE_SUPPORTED      (PNLFS_FEATURE_EXTENTS | \
+				      PNLFS_FEATURE_INDIRECT | \
+				      PNLFS_FEATURE_DIR_INDEX | \
+				      PNLFS_FEATURE_FILETYPE | \
+				      PNLFS_FEATURE_BLOCK_GROUPS | \
+				      PNLFS_FEATURE_UNWRITTEN | \
+				      PNLFS_FEATURE_INLINE_DATA | \
+				      PNLFS_FEATURE_TAIL_PACKING | \
+				      PNLFS_FEATURE_INLINE_DIR)
+
+/* Inode flags, only stored by large inodes */
+#define PNLFS_INODE_EXTENTS          0x0001  /* Blocks mapped by extents */
+#define PNLFS_INODE_INLINE           0x0002  /* Data or entries stored in the
+						inode */
+#define PNLFS_INODE_FRAG             0x0004  /* Data stored in a fragment */
+
 
 /*
  * pnlFS partition layout
@@ -29,6 +70,24 @@
  * |      blocks   |  rest of the blocks
  * +---------------+
  *
+ * With PNLFS_FEATURE_BLOCK_GROUPS, the disk is split in groups of
+ * sb->blocks_per_group blocks, each one with its own bitmaps and inode
+ * table, described by a table of group descriptors :
+ *
+ * +---------------+
+ * |  superblock   |  1 block
+ * +---------------+
+ * | group descs   |  ceil(sb->nr_groups / PNLFS_DESCS_PER_BLOCK) blocks
+ * +---------------+
+ * |   group 0     |  bfree bitmap, ifree bitmap, inode table, data blocks
+ * +---------------+
+ * |   group 1     |  from block sb->blocks_per_group
+ * +---------------+
+ * |     ...       |
+ * +---------------+
+ *
+ * Group g holds the blocks from g * sb->blocks_per_group and the inodes from
+ * g * sb->inodes_per_group, a bitmap block covering each of them.
  */
 
 struct pnlfs_inode {
@@ -41,14 +100,151 @@ struct pnlfs_inode {
 	};
 };
 
+#define PNLFS_INODES_PER_BLOCK (PNLFS_BLOCK_SIZE / sizeof(struct pnlfs_inode))
+
+/*
+ * Extents map len blocks of a file starting at the logical block block on
+ * contiguous blocks of the disk starting at start. They are kept sorted by
+ * logical block, inline in the inode as long as they fit. Past that, the
+ * header of the inline ones points to the top of a tree of extent blocks :
+ * its leaves hold extents, and the index blocks above them hold the first
+ * logical block and the location of each of their children. The first entry
+ * of an index block also covers the blocks before its own first one.
+ * With PNLFS_FEATURE_UNWRITTEN, the length of an extent may have
+ * PNLFS_EXTENT_UNWRITTEN set, its blocks being preallocated by fallocate().
+ */
+struct pnlfs_extent {
+	__le32 block;             /* First logical block */
+	__le32 start;             /* First physical block */
+	__le32 len;               /* Number of blocks */
+};
+
+struct pnlfs_extent_index {
+	__le32 block;             /* First logical block of the child */
+	__le32 child;             /* Extent block of the child */
+	__le32 reserved;
+};
+
+struct pnlfs_extent_header {
+	__le32 nr_extents;        /* Number of extents in use */
+	__le32 extent_block;      /* Top extent block, 0 if extents are inline */
+};
+
+/* An extent block with a single leaf has the layout of the early ones */
+struct pnlfs_extent_node_header {
+	__le32 nr_entries;        /* Number of extents or index entries */
+	__le32 depth;             /* Levels below, 0 for a leaf */
+};
+
+#define PNLFS_INODE_DATA_SIZE        96
+#define PNLFS_INLINE_EXTENTS         7
+#define PNLFS_EXTENTS_PER_BLOCK      340
+#define PNLFS_EXTENT_MAX_DEPTH       5
+#define PNLFS_EXTENT_MAX_LEN         (1 << 15)
+#define PNLFS_EXTENT_UNWRITTEN       (1U << 31)
+#define PNLFS_MAX_EXTENT_FILESIZE    ((loff_t) PNLFS_BLOCK_SIZE << 32)
+
+struct pnlfs_extent_root {
+	struct pnlfs_extent_header header;
+	struct pnlfs_extent extents[PNLFS_INLINE_EXTENTS];
+};
+
+struct pnlfs_extent_block {
+	struct pnlfs_extent_node_header header;
+	union {
+		struct pnlfs_extent extents[PNLFS_EXTENTS_PER_BLOCK];
+		struct pnlfs_extent_index index[PNLFS_EXTENTS_PER_BLOCK];
+	};
+	char padding[8];          /* Padding to match block size */
+};
+
+/*
+ * Large inodes are used when a feature needs more room than struct
+ * pnlfs_inode, they start with the same fields.
+ *
+ * With PNLFS_FEATURE_INLINE_DATA, a new regular file is flagged
+ * PNLFS_INODE_INLINE : it has no block, its first PNLFS_INODE_DATA_SIZE bytes
+ * are stored in data. It moves to a data block, mapped by its extents or by a
+ * new index block, once it grows past that.
+ *
+ * With PNLFS_FEATURE_TAIL_PACKING, a file smaller than PNLFS_FRAG_MAX_SIZE
+ * which doesn't fit in its inode is flagged PNLFS_INODE_FRAG : its data is
+ * stored in a fragment, a run of slots of a block shared with other files,
+ * described by frag. Without PNLFS_FEATURE_INLINE_DATA, a new regular file
+ * is flagged PNLFS_INODE_FRAG with no fragment yet.
+ */
+struct pnlfs_frag {
+	__le32 block;             /* Shared block, 0 for no fragment */
+	__le16 slot;              /* First slot */
+	__le16 nr_slots;          /* Number of slots */
+};
+
+struct pnlfs_inode_large {
+	struct pnlfs_inode inode;
+	__le32 flags;             /* Inode flags */
+	__le32 filesize_hi;       /* High 32 bits of the file size */
+	__le32 reserved[2];
+	union {
+		struct pnlfs_extent_root extent_root;
+		struct pnlfs_frag frag;
+		__u8 data[PNLFS_INODE_DATA_SIZE];
+	};
+};
+
+#define PNLFS_LARGE_INODE_SIZE       128
+
+/*
+ * A block of fragments is cut in PNLFS_FRAG_SIZE slots, the first of them
+ * holding its header : a bitmap with a bit set for each slot in use, the
+ * header's included.
+ */
+struct pnlfs_frag_header {
+	__le32 magic;             /* PNLFS_FRAG_MAGIC */
+	__le32 used;              /* Slots in use */
+};
+
+#define PNLFS_FRAG_MAGIC             0x47415246
+#define PNLFS_FRAG_SIZE              128
+#define PNLFS_FRAGS_PER_BLOCK        (PNLFS_BLOCK_SIZE / PNLFS_FRAG_SIZE)
+#define PNLFS_FRAG_MAX_SIZE          ((PNLFS_FRAGS_PER_BLOCK - 1) * \
+				      PNLFS_FRAG_SIZE)
+
+struct pnl_extent;
+struct pnl_dir_cache;
+
 struct pnlfs_inode_info {
 	uint32_t index_block;
 	uint32_t nr_entries;
+	uint32_t flags;           /* Inode flags */
+	__u8 i_data[PNLFS_INODE_DATA_SIZE]; /* Inline area of large inodes */
+	spinlock_t data_lock;     /* Protects i_data and flags as they change */
+	struct mutex index_lock;  /* Protects the block mapping and its cache */
+	struct rw_semaphore map_sem; /* Keeps page faults out of a hole punch */
+	/*
+	 * Decoded index blocks met on the last lookups : the index block, the
+	 * single indirect block, the double indirect block and one of its
+	 * single indirect blocks.
+	 */
+	struct pnl_index_cache {
+		uint32_t bno;
+		uint32_t *blocks; /* NULL until needed */
+	} index_cache[4];
+	/*
+	 * Decoded extents of the inline root or of the leaf ext_leaf met on
+	 * the last lookup, which covers the logical blocks from ext_first to
+	 * ext_last.
+	 */
+	uint32_t nr_extents;
+	struct pnl_extent *extents; /* NULL until needed */
+	uint32_t ext_leaf;
+	uint32_t ext_first;
+	uint32_t ext_last;
+	struct rw_semaphore dir_sem; /* Protects the entries of a directory */
+	struct pnl_dir_cache *dir_cache; /* Entries by name, NULL until needed */
+	bool released;            /* Lost its last link, see pnl_evict_inode() */
 	struct inode vfs_inode;
 };
 
-#define PNLFS_INODES_PER_BLOCK (PNLFS_BLOCK_SIZE / sizeof(struct pnlfs_inode))
-
 struct pnlfs_superblock {
 	__le32 magic;	        /* Magic number */
 
@@ -62,9 +258,35 @@ struct pnlfs_superblock {
 	__le32 nr_free_inodes;  /* Number of free inodes */
 	__le32 nr_free_blocks;  /* Number of free blocks */
 
-	char padding[4064];     /* Padding to match block size */
+	__le32 features;        /* Optional features */
+
+	/* PNLFS_FEATURE_BLOCK_GROUPS */
+	__le32 blocks_per_group;/* Number of blocks in a group */
+	__le32 inodes_per_group;/* Number of inodes in a group */
+	__le32 nr_groups;       /* Number of groups */
+
+	char padding[4048];     /* Padding to match block size */
+};
+
+struct pnlfs_group_desc {
+	__le32 block_bitmap;    /* Block of the bfree bitmap */
+	__le32 inode_bitmap;    /* Block of the ifree bitmap */
+	__le32 inode_table;     /* First block of the inode table */
+	__le32 nr_free_blocks;  /* Number of free blocks */
+	__le32 nr_free_inodes;  /* Number of free inodes */
+	__le32 nr_dirs;         /* Number of directories */
+	__le32 reserved[2];
 };
 
+#define PNLFS_GDT_BLOCK_NR           1
+#define PNLFS_DESCS_PER_BLOCK        (PNLFS_BLOCK_SIZE / \
+				      sizeof(struct pnlfs_group_desc))
+
+struct pnl_group;
+struct pnl_stats;
+
+#define PNL_FRAG_BLOCKS              8
+
 struct pnlfs_sb_info {
 	uint32_t nr_blocks;      /* Total number of blocks (incl sb & inodes) */
 	uint32_t nr_inodes;      /* Total number of inodes */
@@ -73,17 +295,81 @@ struct pnlfs_sb_info {
 	uint32_t nr_ifree_blocks; /* Number of inode free bitmap blocks */
 	uint32_t nr_bfree_blocks; /* Number of block free bitmap blocks */
 
-	uint32_t nr_free_inodes;  /* Number of free inodes */
-	uint32_t nr_free_blocks;  /* Number of free blocks */
+	/* Kept by pnl_alloc.c, written back to the superblock on sync */
+	struct percpu_counter free_inodes; /* Number of free inodes */
+	struct percpu_counter free_blocks; /* Number of free blocks */
+	struct percpu_counter nr_dirs;     /* Number of directories */
 
-	unsigned long *ifree_bitmap;
-	unsigned long *bfree_bitmap;
+	uint32_t features;        /* Optional features */
+	uint32_t inode_size;      /* Size of an on-disk inode */
+	uint32_t inodes_per_block;
+
+	uint32_t nr_groups;       /* Number of groups, see struct pnl_group */
+	uint32_t blocks_per_group;
+	uint32_t inodes_per_group;
+	struct pnl_group **groups; /* Groups, NULL until used */
+	uint32_t __percpu *block_hint; /* Where each CPU allocates next */
+	struct shrinker shrinker;  /* Releases the idle group bitmaps */
+	atomic_t nr_bitmaps;       /* Group bitmaps held */
+	uint32_t shrink_next;      /* Group the shrinker goes on from */
+	spinlock_t dirty_lock;     /* Protects dirty_groups */
+	struct list_head dirty_groups; /* Groups to write on the next sync */
+	uint32_t nr_dirty_groups;
+	struct pnl_stats __percpu *stats; /* See pnl_stats.h */
+	struct dentry *debugfs_dir;
+	struct mutex frag_lock;    /* Protects the blocks of fragments */
+	/* Blocks of fragments known to have free slots, most recent first */
+	uint32_t frag_blocks[PNL_FRAG_BLOCKS];
+	uint32_t nr_frag_blocks;
 };
 
+#define PNLFS_BITS_PER_BLOCK         (PNLFS_BLOCK_SIZE * 8)
+
+/*
+ * Logical block N of a file is stored in blocks[N], a zero entry being a hole.
+ *
+ * With PNLFS_FEATURE_INDIRECT, only the first PNLFS_DIRECT_BLOCKS entries of
+ * the index block of a file map data blocks. The next one points to a single
+ * indirect block, an index block mapping the following
+ * PNLFS_INDEX_ENTRIES blocks, and the last one to a double indirect block,
+ * an index block of single indirect blocks.
+ *
+ * With PNLFS_FEATURE_UNWRITTEN, an entry mapping a data block may have
+ * PNLFS_INDEX_UNWRITTEN set : the block was reserved by fallocate() and reads
+ * as zeroes until it is first written.
+ */
 struct pnlfs_file_index_block {
 	__le32 blocks[PNLFS_BLOCK_SIZE >> 2];
 };
 
+#define PNLFS_INDEX_UNWRITTEN        (1U << 31)
+
+#define PNLFS_INDEX_ENTRIES          (PNLFS_BLOCK_SIZE >> 2)
+#define PNLFS_DIRECT_BLOCKS          (PNLFS_INDEX_ENTRIES - 2)
+#define PNLFS_IND_BLOCK              (PNLFS_INDEX_ENTRIES - 2)
+#define PNLFS_DIND_BLOCK             (PNLFS_INDEX_ENTRIES - 1)
+#define PNLFS_MAX_INDIRECT_FILESIZE  ((loff_t) U32_MAX) /* 32 bits filesize */
+
+/*
+ * With PNLFS_FEATURE_DIR_INDEX, the index block of a directory maps its
+ * blocks like the ones of a file, indirect blocks included, and entries are
+ * spread over them by linear hashing of their names : the directory is
+ * i_size / PNLFS_BLOCK_SIZE blocks long and an entry lives in the block given
+ * by pnl_dir_bucket(). A free slot has a zero inode. Without it, a directory
+ * is a single block, its index block.
+ *
+ * With PNLFS_FEATURE_FILETYPE, the last byte of filename holds the DT_ type
+ * of the inode, so names are one byte shorter.
+ *
+ * With PNLFS_FEATURE_INLINE_DIR, a new directory is flagged
+ * PNLFS_INODE_INLINE : it has no block, its first PNLFS_INLINE_DIR_ENTRIES
+ * entries are stored in the data of its large inode, as block 0. They move
+ * to a block, at the same slots, once another entry is added.
+ *
+ * readdir positions are 2 + block * PNLFS_MAX_DIR_ENTRIES + slot, after the
+ * dot entries.
+ */
+
 struct pnlfs_dir_block {
 	struct pnlfs_file {
 		__le32 inode;
@@ -91,4 +377,7 @@ struct pnlfs_dir_block {
 	} files[PNLFS_MAX_DIR_ENTRIES];
 };
 
+#define PNLFS_INLINE_DIR_ENTRIES     (PNLFS_INODE_DATA_SIZE / \
+				      sizeof(struct pnlfs_file))
+
 #endif	/* _PNLFS_H */
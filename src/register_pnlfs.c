@@ -5,114 +5,144 @@
 #include <linux/dcache.h>
 #include <linux/buffer_head.h>
 #include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/percpu_counter.h>
+#include <linux/statfs.h>
 #include <uapi/asm-generic/errno-base.h>
 #include <uapi/asm-generic/errno.h>
 #include <uapi/linux/stat.h>
 #include <uapi/linux/fs.h>
 #include "pnlfs.h"
 #include "pnl_inode.h"
+#include "pnl_alloc.h"
+#include "pnl_dir.h"
+#include "pnl_stats.h"
+
+#define CREATE_TRACE_POINTS
+#include "pnl_trace.h"
 
 MODULE_DESCRIPTION("PNLfs registration module");
 MODULE_AUTHOR("Kevin Mambu, M1 SESI");
 MODULE_LICENSE("GPL");
 
+struct kmem_cache *pnl_inode_cachep;
+
 void pnl_put_super (struct super_block *sb) {
 	struct pnlfs_sb_info *sb_info = (struct pnlfs_sb_info *) sb->s_fs_info;
-	kfree(sb_info->ifree_bitmap);
-	kfree(sb_info->bfree_bitmap);
+	pnl_alloc_destroy(sb);
+	pnl_stats_exit(sb);
 	kfree(sb_info);
 }
 
+/*
+ * Writes the superblock along with the groups changed since the last sync,
+ * all of them submitted before waiting for any.
+ */
 int pnl_sync_fs(struct super_block *sb, int wait)
 {
 	struct pnlfs_superblock *raw_sb;
 	struct pnlfs_sb_info *sbi;
 	struct buffer_head *bh;
-	uint32_t bno = PNLFS_SB_BLOCK_NR, k, i, j, lno;
-	unsigned long *ifree_bitmap, *bfree_bitmap, *b_data;
+	u64 start = ktime_get_ns();
+	int err;
 
 	sbi = (struct pnlfs_sb_info *) sb->s_fs_info;
-	bh = sb_bread(sb, bno);
+	bh = pnl_sb_bread(sb, PNLFS_SB_BLOCK_NR);
+	if (!bh) {
+		pr_warn("[pnlfs] %s : error when opening block sector %d\n",
+				__func__, PNLFS_SB_BLOCK_NR);
+		return -EIO;
+	}
 	raw_sb = (struct pnlfs_superblock *) bh->b_data;
-	raw_sb->nr_free_inodes = cpu_to_le32(sbi->nr_free_inodes);
-	raw_sb->nr_free_blocks = cpu_to_le32(sbi->nr_free_blocks);
+	lock_buffer(bh);
+	raw_sb->nr_free_inodes = cpu_to_le32((uint32_t)
+			percpu_counter_sum_positive(&sbi->free_inodes));
+	raw_sb->nr_free_blocks = cpu_to_le32((uint32_t)
+			percpu_counter_sum_positive(&sbi->free_blocks));
+	unlock_buffer(bh);
 	mark_buffer_dirty(bh);
+	if (wait)
+		write_dirty_buffer(bh, 0);
+	err = pnl_alloc_sync(sb, wait);
 	if (wait) {
-		pr_warn("[pnlfs] %s : WAIT_ON\n", __func__);
-		if(sync_dirty_buffer(bh) != 0)
-			pr_warn("FAILURE\n");
+		wait_on_buffer(bh);
+		if (!buffer_uptodate(bh))
+			err = -EIO;
 	}
-	pr_warn("[pnlfs] %s : block sector %d successfully written\n",
-			__func__, bno);
 	brelse(bh);
-	
-	ifree_bitmap = sbi->ifree_bitmap;
-	bfree_bitmap = sbi->bfree_bitmap;
-	lno = PNLFS_BLOCK_SIZE / sizeof(unsigned long);
-	bno += 1 + sbi->nr_istore_blocks;
-	k = 0;
-	for (i=0; i<sbi->nr_ifree_blocks; i++)
-	{
-		bh = sb_bread(sb, bno + i);
-		b_data = (unsigned long *) bh->b_data;
-		for (j=0; j<lno; j++)
-			b_data[j] = cpu_to_le64(ifree_bitmap[k++]);
-		mark_buffer_dirty(bh);
-		if (wait) {
-			pr_warn("[pnlfs] %s : WAIT_ON\n", __func__);
-			if(sync_dirty_buffer(bh) != 0)
-				pr_warn("FAILURE\n");
-		}
-		pr_warn("[pnlfs] %s : block sector %d successfully written\n",
-				__func__, bno);
-		brelse(bh);
-	}
-	
-	bno += sbi->nr_ifree_blocks;
-	k = 0;
-	for (i=0; i<sbi->nr_bfree_blocks; i++)
-	{
-		bh = sb_bread(sb, bno + i);
-		b_data = (unsigned long *) bh->b_data;
-		for (j=0; j<lno; j++)
-			b_data[j] = cpu_to_le64(bfree_bitmap[k++]);
-		mark_buffer_dirty(bh);
-		if (wait) {
-			pr_warn("[pnlfs] %s : WAIT_ON\n", __func__);
-			if(sync_dirty_buffer(bh) != 0)
-				pr_warn("FAILURE\n");
-		}
-		pr_warn("[pnlfs] %s : block sector %d successfully written\n",
-				__func__, bno);
-		brelse(bh);
-	}
+	pnl_stat_inc(sb, PNL_STAT_SYNCS);
+	pnl_stat_add(sb, PNL_STAT_SYNC_NS, ktime_get_ns() - start);
+	trace_pnlfs_sync(sb, wait, err);
+	return err;
+}
 
+/*
+ * Served from the free counters as they are, without summing the deltas of
+ * the CPUs : statfs is meant to be cheap, not exact to the block.
+ */
+int pnl_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+	struct super_block *sb = dentry->d_sb;
+	struct pnlfs_sb_info *sbi = (struct pnlfs_sb_info *) sb->s_fs_info;
+	u64 id = huge_encode_dev(sb->s_bdev->bd_dev);
+
+	buf->f_type = PNLFS_MAGIC;
+	buf->f_bsize = PNLFS_BLOCK_SIZE;
+	buf->f_blocks = sbi->nr_blocks;
+	buf->f_bfree = percpu_counter_read_positive(&sbi->free_blocks);
+	buf->f_bavail = buf->f_bfree;
+	buf->f_files = sbi->nr_inodes;
+	buf->f_ffree = percpu_counter_read_positive(&sbi->free_inodes);
+	buf->f_namelen = pnl_dir_name_len(sb);
+	buf->f_fsid.val[0] = (u32) id;
+	buf->f_fsid.val[1] = (u32) (id >> 32);
 	return 0;
 }
 
+/* Checks that the groups cover the whole disk, each with its bitmaps */
+static bool pnl_check_groups(struct pnlfs_sb_info *sb_info)
+{
+	uint32_t bpg = sb_info->blocks_per_group;
+	uint32_t ipg = sb_info->inodes_per_group;
+
+	if (!bpg || bpg > PNLFS_BITS_PER_BLOCK || !ipg ||
+			ipg > PNLFS_BITS_PER_BLOCK ||
+			ipg % sb_info->inodes_per_block)
+		return false;
+	if (sb_info->nr_groups != DIV_ROUND_UP(sb_info->nr_blocks, bpg) &&
+			(sb_info->features & PNLFS_FEATURE_BLOCK_GROUPS))
+		return false;
+	return (uint64_t) sb_info->nr_groups * bpg >= sb_info->nr_blocks &&
+		(uint64_t) sb_info->nr_groups * ipg >= sb_info->nr_inodes;
+}
+
 struct super_operations pnl_sops = {
 	.put_super = pnl_put_super,
 	.alloc_inode = pnl_alloc_inode,
 	.destroy_inode = pnl_destroy_inode,
-	//.sync_fs = pnl_sync_fs,
-	//.write_inode = pnl_write_inode,
+	.sync_fs = pnl_sync_fs,
+	.write_inode = pnl_write_inode,
+	.evict_inode = pnl_evict_inode,
+	.statfs = pnl_statfs,
 };
 
 int pnl_fill_super(struct super_block *sb, void *data, int silent)
 {
-	uint32_t nr_inodes, nr_blocks, lno, i, j, k, nr_istore_blocks,
-		 nr_ifree_blocks, bno, nr_bfree_blocks;
-	unsigned long *ifree_bitmap, *bfree_bitmap, *b_data;
+	uint32_t nr_inodes, nr_blocks, nr_istore_blocks, nr_ifree_blocks,
+		 nr_bfree_blocks;
 	struct inode *root_inode;
 	struct buffer_head *bh;
 	struct pnlfs_superblock *raw_sb;
 	struct pnlfs_sb_info *sb_info;
+	int err;
 
 	sb->s_magic = PNLFS_MAGIC;
-	sb->s_blocksize = PNLFS_BLOCK_SIZE;
-	sb->s_maxbytes = PNLFS_MAX_FILESIZE;
+	if (!sb_set_blocksize(sb, PNLFS_BLOCK_SIZE)) {
+		pr_err("[pnlfs] %s : unable to set block size\n", __func__);
+		return -EINVAL;
+	}
 	sb->s_op = &pnl_sops;
-	sb_info = (struct pnlfs_sb_info *) kmalloc
+	sb_info = (struct pnlfs_sb_info *) kzalloc
 		(sizeof(struct pnlfs_sb_info), GFP_KERNEL);
 	sb->s_fs_info = (void *)sb_info;
 
@@ -128,49 +158,77 @@ int pnl_fill_super(struct super_block *sb, void *data, int silent)
 				 = le32_to_cpu(raw_sb->nr_ifree_blocks);
 	sb_info->nr_bfree_blocks = nr_bfree_blocks
 				 = le32_to_cpu(raw_sb->nr_bfree_blocks);
-	sb_info->nr_free_inodes = le32_to_cpu(raw_sb->nr_free_inodes);
-	sb_info->nr_free_blocks = le32_to_cpu(raw_sb->nr_free_blocks);
+	sb_info->features = le32_to_cpu(raw_sb->features);
+	sb_info->blocks_per_group = le32_to_cpu(raw_sb->blocks_per_group);
+	sb_info->inodes_per_group = le32_to_cpu(raw_sb->inodes_per_group);
+	sb_info->nr_groups = le32_to_cpu(raw_sb->nr_groups);
 	brelse(bh);
 
-	lno = PNLFS_BLOCK_SIZE / sizeof(unsigned long);
-	ifree_bitmap = (unsigned long *) kmalloc
-		(PNLFS_BLOCK_SIZE * nr_ifree_blocks, GFP_KERNEL);
-	sb_info->ifree_bitmap = ifree_bitmap;
-	bfree_bitmap = (unsigned long *) kmalloc
-		(PNLFS_BLOCK_SIZE * nr_bfree_blocks, GFP_KERNEL);
-	sb_info->bfree_bitmap = bfree_bitmap;
-
-	bno = 1 + nr_istore_blocks;
-	k = 0;
-	for (i=0; i<nr_ifree_blocks; i++)
-	{
-		bh = sb_bread(sb, bno + i);
-		b_data = (unsigned long *) bh->b_data;
-		for (j=0; j<lno; j++)
-			ifree_bitmap[k++] = le64_to_cpu(b_data[j]);
-		brelse(bh);
+	if (sb_info->features & ~PNLFS_FEATURE_SUPPORTED) {
+		pr_err("[pnlfs] %s : unsupported features %#x\n", __func__,
+				sb_info->features & ~PNLFS_FEATURE_SUPPORTED);
+		sb->s_fs_info = NULL;
+		kfree(sb_info);
+		return -EINVAL;
+	}
+	if (sb_info->features & (PNLFS_FEATURE_EXTENTS |
+				 PNLFS_FEATURE_INLINE_DATA |
+				 PNLFS_FEATURE_TAIL_PACKING |
+				 PNLFS_FEATURE_INLINE_DIR))
+		sb_info->inode_size = PNLFS_LARGE_INODE_SIZE;
+	else
+		sb_info->inode_size = sizeof(struct pnlfs_inode);
+	if (sb_info->features & PNLFS_FEATURE_EXTENTS)
+		sb->s_maxbytes = PNLFS_MAX_EXTENT_FILESIZE;
+	else if (sb_info->features & PNLFS_FEATURE_INDIRECT)
+		sb->s_maxbytes = PNLFS_MAX_INDIRECT_FILESIZE;
+	else
+		sb->s_maxbytes = PNLFS_MAX_FILESIZE;
+	sb_info->inodes_per_block = PNLFS_BLOCK_SIZE / sb_info->inode_size;
+
+	if (!(sb_info->features & PNLFS_FEATURE_BLOCK_GROUPS)) {
+		/* each block of the global bitmaps makes a group */
+		sb_info->blocks_per_group = PNLFS_BITS_PER_BLOCK;
+		sb_info->inodes_per_group = PNLFS_BITS_PER_BLOCK;
+		sb_info->nr_groups = max(nr_ifree_blocks, nr_bfree_blocks);
 	}
-	
-	bno += nr_ifree_blocks;
-	k = 0;
-	for (i=0; i<nr_bfree_blocks; i++)
-	{
-		bh = sb_bread(sb, bno + i);
-		b_data = (unsigned long *) bh->b_data;
-		for (j=0; j<lno; j++)
-			bfree_bitmap[k++] = le64_to_cpu(b_data[j]);
-		brelse(bh);
+	if (!pnl_check_groups(sb_info)) {
+		pr_err("[pnlfs] %s : corrupted block groups geometry\n",
+				__func__);
+		sb->s_fs_info = NULL;
+		kfree(sb_info);
+		return -EINVAL;
 	}
+	err = pnl_stats_init(sb);
+	if (err)
+		goto fill_super_free;
+	err = pnl_alloc_init(sb);
+	if (err)
+		goto fill_super_stats;
 
 	root_inode = pnl_iget(sb, 0);
-	if(IS_ERR(root_inode))
-		return PTR_ERR(root_inode);
+	if(IS_ERR(root_inode)) {
+		err = PTR_ERR(root_inode);
+		goto fill_super_destroy;
+	}
 	inode_init_owner(root_inode, NULL, S_IFDIR | root_inode->i_mode);
 	sb->s_root = d_make_root(root_inode);
-	if (!sb->s_root)
-		return -ENOMEM;
-	pr_info("[pnlfs] pnl_fill_super() : success\n");
+	if (!sb->s_root) {
+		err = -ENOMEM;
+		goto fill_super_destroy;
+	}
+	pnl_debug("%s : success\n", __func__);
 	return 0;
+
+	/* put_super() is not called without a root */
+fill_super_destroy:
+	pnl_alloc_destroy(sb);
+fill_super_stats:
+	pnl_stats_exit(sb);
+fill_super_free:
+	sb->s_fs_info = NULL;
+	kfree(sb_info);
+	return err;
 }
 
 struct dentry *pnl_mount(struct file_system_type *fs_type, int flags,
@@ -181,7 +239,7 @@ struct dentry *pnl_mount(struct file_system_type *fs_type, int flags,
 
 void pnl_kill_sb(struct super_block *sb)
 {
-	pr_warn("[pnlfs] %s : calling kill_block_super()\n", __func__);
+	pnl_debug("%s : calling kill_block_super()\n", __func__);
 	kill_block_super(sb);
 }
 
@@ -196,8 +254,25 @@ struct file_system_type pnlfs_type = {
 
 int init_module(void)
 {
-	if (register_filesystem(&pnlfs_type) != 0)
+	int err;
+
+	pnl_inode_cachep = kmem_cache_create("pnlfs_inode_cache",
+			sizeof(struct pnlfs_inode_info), 0,
+			SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD | SLAB_ACCOUNT,
+			pnl_init_once);
+	if (!pnl_inode_cachep) {
+		pr_err("[pnlfs] unable to create the inode cache\n");
+		return -ENOMEM;
+	}
+	/* before any mount creates its own directory */
+	pnl_debugfs_init();
+	err = register_filesystem(&pnlfs_type);
+	if (err) {
 		pr_err("[pnlfs] registration failed unexpectedly\n");
+		pnl_debugfs_exit();
+		kmem_cache_destroy(pnl_inode_cachep);
+		return err;
+	}
 	pr_info("[pnlfs] registration successful\n");
 	return 0;
 }
@@ -206,5 +281,9 @@ void cleanup_module(void)
 {
 	if (unregister_filesystem(&pnlfs_type) != 0)
 		pr_err("[pnlfs] unregistration failed unexpectedly\n");
+	pnl_debugfs_exit();
+	/* wait for the inodes freed by pnl_destroy_inode() */
+	rcu_barrier();
+	kmem_cache_destroy(pnl_inode_cachep);
 	pr_info("[pnlfs] unregistration successful\n");
 }